@@ -21,6 +21,9 @@
 #include <err.h>
 #include <ctype.h>
 #include <malloc.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
 
 #include "e3d.h"
 
@@ -39,10 +42,62 @@ mymalloc (size_t n)
   return m;
 }
 
+typedef struct parallel_s parallel_t;
+struct parallel_s
+{				// Work shared between threads
+  int n;			// number of jobs
+  int next;			// next job to take
+  void (*fn) (void *, int);
+  void *arg;
+};
+
+static void *
+parallel_worker (void *arg)
+{
+  parallel_t *p = arg;
+  int i;
+  while ((i = __sync_fetch_and_add (&p->next, 1)) < p->n)
+    p->fn (p->arg, i);
+  return NULL;
+}
+
+int
+workers (void)
+{				// Number of worker threads to use
+  if (threads > 0)
+    return threads;
+  int n = sysconf (_SC_NPROCESSORS_ONLN);
+  return n > 0 ? n : 1;
+}
+
+void
+parallel (int n, void (*fn) (void *, int), void *arg)
+{				// Run fn(arg,i) for i from 0 to n-1, spread over worker threads, returns when all done
+  int t = workers ();
+  if (t > n)
+    t = n;
+  if (t <= 1)
+    {				// simple
+      int i;
+      for (i = 0; i < n; i++)
+	fn (arg, i);
+      return;
+    }
+  parallel_t p = {.n = n,.fn = fn,.arg = arg };
+  pthread_t thread[t - 1];
+  int i;
+  for (i = 0; i < t - 1; i++)
+    if (pthread_create (&thread[i], NULL, parallel_worker, &p))
+      errx (1, "Cannot create thread");
+  parallel_worker (&p);
+  for (i = 0; i < t - 1; i++)
+    pthread_join (thread[i], NULL);
+}
+
 char *
 dimplaces (poly_dim_t v, int places)
 {
-  static char val[100];
+  static __thread char val[100];
   char *c = val;
 #ifdef FIXED
   if (v < 0)
@@ -65,19 +120,156 @@ dimplaces (poly_dim_t v, int places)
 polygon_t *
 poly_sub (polygon_t * a, polygon_t * b)
 {
-  polygon_t *d = poly_clip (POLY_DIFFERENCE, 2, a, b);
-  polygon_t *r = poly_clip (POLY_INTERSECT, 2, a, d);
-  poly_free (d);
-  return r;
+  if (!poly_overlap (a, b))
+    return poly_clip (POLY_UNION, 1, a);	// nothing to take away
+  return poly_clip (POLY_SUBTRACT, 2, a, b);
+}
+
+struct grid_s
+{				// Uniform grid of points, for nearest point
+  poly_dim_t minx, miny, size;	// origin and cell size
+  int w, h;			// cells
+  int *cell;			// first point in each cell, -1 for none
+  int count;			// points in grid
+  struct
+  {
+    poly_dim_t x, y;
+    unsigned long long key;
+    int cell;			// which cell
+    int prev, next;		// in cell, -1 for none
+  } *point;
+};
+
+grid_t *
+grid_new (poly_dim_t minx, poly_dim_t miny, poly_dim_t maxx, poly_dim_t maxy, int n, int ids)
+{				// Grid for about n points in this box, about one per cell, numbered 0 to ids-1
+  grid_t *g = mymalloc (sizeof (*g));
+  int s = sqrt (n) + 1;
+  g->minx = minx;
+  g->miny = miny;
+  g->size = MAX (maxx - minx, maxy - miny) / s + 1;
+  g->w = (maxx - minx) / g->size + 1;
+  g->h = (maxy - miny) / g->size + 1;
+  g->cell = mymalloc (g->w * g->h * sizeof (*g->cell));
+  memset (g->cell, -1, g->w * g->h * sizeof (*g->cell));
+  g->point = mymalloc (ids * sizeof (*g->point) + 1);
+  return g;
+}
+
+void
+grid_free (grid_t * g)
+{
+  if (!g)
+    return;
+  free (g->cell);
+  free (g->point);
+  free (g);
+}
+
+static int
+grid_cell (poly_dim_t v, poly_dim_t min, poly_dim_t size, int w)
+{				// cell index, clamped to grid
+  v = (v - min) / size;
+  return v < 0 ? 0 : v >= w ? w - 1 : (int) v;
+}
+
+void
+grid_add (grid_t * g, int i, poly_dim_t x, poly_dim_t y, unsigned long long key)
+{				// Add point i
+  int c = grid_cell (y, g->miny, g->size, g->h) * g->w + grid_cell (x, g->minx, g->size, g->w);
+  g->point[i].x = x;
+  g->point[i].y = y;
+  g->point[i].key = key;
+  g->point[i].cell = c;
+  g->point[i].prev = -1;
+  g->point[i].next = g->cell[c];
+  if (g->cell[c] >= 0)
+    g->point[g->cell[c]].prev = i;
+  g->cell[c] = i;
+  g->count++;
 }
 
 void
-poly_order (polygon_t * p, poly_dim_t * xp, poly_dim_t * yp)
+grid_remove (grid_t * g, int i)
+{				// Remove point i
+  if (g->point[i].prev >= 0)
+    g->point[g->point[i].prev].next = g->point[i].next;
+  else
+    g->cell[g->point[i].cell] = g->point[i].next;
+  if (g->point[i].next >= 0)
+    g->point[g->point[i].next].prev = g->point[i].prev;
+  g->count--;
+}
+
+void
+grid_key (grid_t * g, int i, unsigned long long key)
+{				// Change tie break key of point i
+  g->point[i].key = key;
+}
+
+int
+grid_count (grid_t * g)
+{				// Points in grid
+  return g->count;
+}
+
+int
+grid_nearest (grid_t * g, poly_dim_t x, poly_dim_t y)
+{				// Closest point to x,y, by whole units of distance as sqrtl would give, lowest key on a tie, -1 if none
+  poly_dim_t best2 = -1, limit = -1;
+  int cx = grid_cell (x, g->minx, g->size, g->w), cy = grid_cell (y, g->miny, g->size, g->h), best = -1, pass, r;
+  if (!g->count)
+    return -1;
+  for (pass = 0; pass < 2; pass++)
+    {				// first the closest, then the lowest key that is as close
+      for (r = 0; r <= g->w || r <= g->h; r++)
+	{			// rings of cells round x,y, anything outside ring r is more than r cells away
+	  int i, j, k;
+	  for (j = cy - r; j <= cy + r; j++)
+	    if (j >= 0 && j < g->h)
+	      for (i = cx - r; i <= cx + r; i += ((j == cy - r || j == cy + r) ? 1 : 2 * r))
+		{
+		  if (i >= 0 && i < g->w)
+		    for (k = g->cell[j * g->w + i]; k >= 0; k = g->point[k].next)
+		      {
+			poly_dim_t d2 = (g->point[k].x - x) * (g->point[k].x - x) + (g->point[k].y - y) * (g->point[k].y - y);
+			if (!pass)
+			  {
+			    if (best2 < 0 || d2 < best2)
+			      best2 = d2;
+			  }
+#ifdef	FIXED
+			else if (d2 < limit && (best < 0 || g->point[k].key < g->point[best].key))
+#else
+			else if (d2 <= limit && (best < 0 || g->point[k].key < g->point[best].key))
+#endif
+			  best = k;
+		      }
+		  if (!r)
+		    break;
+		}
+	  poly_dim_t l2 = (pass ? limit : best2);
+	  if (l2 >= 0 && g->size * r * g->size * r >= l2)
+	    break;		// anything further out is further than l2
+	}
+#ifdef	FIXED
+      poly_dim_t d = sqrtl (best2);
+      limit = (d + 1) * (d + 1);	// anything that rounds down to the same distance
+#else
+      limit = best2;
+#endif
+    }
+  return best;
+}
+
+void
+poly_order (polygon_t * p, poly_dim_t * xp, poly_dim_t * yp, int ms)
 {				// reorder contours in a polygon - first polygon stays same, but rest ordered to follow on from first if possible.
-  // Note that we consider c->dir==0 to be special and mean an unclosed path
+  // Note that we consider c->dir==0 to be special and mean an unclosed path, which can be run either way
+  // Nearest next contour by a grid of candidate start points, then if ms then 2-opt and or-opt for up to ms milliseconds
   if (!p)
     return;
-  poly_contour_t *c = p->contours, *n = NULL, **np = &n, **cp;
+  poly_contour_t *c = p->contours;
   while (c && !c->vertices)
     c = c->next;
   if (!c)
@@ -87,45 +279,265 @@ poly_order (polygon_t * p, poly_dim_t * xp, poly_dim_t * yp)
     x = *xp;
   if (yp)
     y = *yp;
-  while (p->contours)
-    {				// find closes contour
-      poly_contour_t *best = NULL;
-      poly_dim_t bestd = 0;
-      poly_vertex_t *bestv = NULL, *bestvp = NULL, *bestve = NULL;
-      for (c = p->contours; c; c = c->next)
-	{			// work out distance
-	  poly_vertex_t *v, *vp = NULL;
-	  for (v = c->vertices; v; v = v->next)
+  poly_dim_t sx = x, sy = y;
+  typedef struct point_s point_t;
+  struct point_s
+  {				// candidate start point, in contour order then vertex order
+    poly_vertex_t *v, *vp;	// vertex and previous vertex
+    int contour;
+  };
+  int n = 0, points = 0, i, j;
+  for (c = p->contours; c; c = c->next)
+    if (c->vertices)
+      {
+	poly_vertex_t *v;
+	n++;
+	for (v = c->vertices; v; v = v->next)
+	  {
+	    points++;
+	    if (!c->dir)
+	      break;		// open path starts at its first point
+	  }
+      }
+  poly_contour_t **list = mymalloc (n * sizeof (*list)), **empty = &p->contours;
+  point_t *point = mymalloc (points * sizeof (*point));
+  int *first = mymalloc ((n + 1) * sizeof (*first));	// first point of each contour
+  n = points = 0;
+  for (c = p->contours; c; c = c->next)
+    if (c->vertices)
+      {
+	poly_vertex_t *v, *vp = NULL;
+	first[n] = points;
+	for (v = c->vertices; v; vp = v, v = v->next)
+	  {
+	    point[points].v = v;
+	    point[points].vp = vp;
+	    point[points++].contour = n;
+	    if (!c->dir)
+	      break;
+	  }
+	list[n++] = c;
+      }
+    else
+      {				// kept, at the end
+	*empty = c;
+	empty = &c->next;
+      }
+  first[n] = points;
+  // Grid of points not yet used, remade smaller as points are used, ties to the first point
+  grid_t *grid = NULL;
+  int gridded = 0;
+  char *used = mymalloc (n);
+  void regrid (void)
+  {
+    int k, live = 0;
+    poly_dim_t minx = 0, miny = 0, maxx = 0, maxy = 0;
+    for (k = 0; k < points; k++)
+      if (!used[point[k].contour])
+	{
+	  poly_dim_t x = point[k].v->x, y = point[k].v->y;
+	  if (!live++)
 	    {
-	      poly_dim_t d = sqrtl ((v->x - x) * (v->x - x) + (v->y - y) * (v->y - y));
-	      if (!best || d < bestd)
-		{
-		  best = c;
-		  bestd = d;
-		  bestv = v;
-		  bestvp = vp;
-		}
-	      vp = v;
-	      if (!c->dir)
-		break;		// special case of no closed path - only consider first point
+	      minx = maxx = x;
+	      miny = maxy = y;
 	    }
-	  if (best == c)
-	    bestve = vp;
+	  minx = MIN (minx, x);
+	  maxx = MAX (maxx, x);
+	  miny = MIN (miny, y);
+	  maxy = MAX (maxy, y);
 	}
-      if (bestvp)
+    grid_free (grid);
+    grid = grid_new (minx, miny, maxx, maxy, live, points);
+    gridded = live;
+    for (k = 0; k < points; k++)
+      if (!used[point[k].contour])
+	grid_add (grid, k, point[k].v->x, point[k].v->y, k);
+  }
+  int *order = mymalloc (n * sizeof (*order));
+  regrid ();
+  for (i = 0; i < n; i++)
+    {				// nearest neighbour
+      if (grid_count (grid) * 4 < gridded && grid_count (grid) > 64)
+	regrid ();
+      int k = grid_nearest (grid, x, y);
+      c = list[point[k].contour];
+      if (point[k].vp)
 	{			// reorder within contour
-	  bestve->next = best->vertices;
-	  bestvp->next = NULL;
-	  best->vertices = bestv;
+	  poly_vertex_t *ve;
+	  for (ve = point[k].v; ve->next; ve = ve->next);
+	  ve->next = c->vertices;
+	  point[k].vp->next = NULL;
+	  c->vertices = point[k].v;
 	}
-      for (cp = &p->contours; *cp != best; cp = &(*cp)->next);
-      *cp = best->next;
-      *np = best;
-      np = &best->next;
-      x = best->vertices->x;
-      y = best->vertices->y;
+      used[point[k].contour] = 1;
+      order[i] = point[k].contour;
+      for (k = first[order[i]]; k < first[order[i] + 1]; k++)
+	grid_remove (grid, k);
+      poly_vertex_t *v;
+      for (v = c->vertices; v->next && !c->dir; v = v->next);
+      x = v->x;			// where this one ends
+      y = v->y;
+    }
+  grid_free (grid);
+  free (first);
+  free (point);
+  free (used);
+  if (ms > 0 && n > 2)
+    {				// improve by reversing and moving runs of contours, until no better or out of time
+      typedef struct end_s end_t;
+      struct end_s
+      {
+	poly_dim_t x, y;
+      };
+      end_t *in = mymalloc (n * sizeof (*in)), *out = mymalloc (n * sizeof (*out)), start = {.x = sx,.y = sy };
+      char *rev = mymalloc (n);
+      for (i = 0; i < n; i++)
+	{
+	  poly_vertex_t *v = list[order[i]]->vertices;
+	  in[i].x = v->x;
+	  in[i].y = v->y;
+	  if (!list[order[i]]->dir)
+	    while (v->next)
+	      v = v->next;
+	  out[i].x = v->x;
+	  out[i].y = v->y;
+	}
+      inline long double dist (end_t a, end_t b)
+      {
+	return sqrtl ((long double) (a.x - b.x) * (a.x - b.x) + (long double) (a.y - b.y) * (a.y - b.y));
+      }
+      inline end_t from (int i)
+      {				// where we are before contour i
+	return i ? out[i - 1] : start;
+      }
+      void reverse (int i, int j)
+      {				// reverse contours i to j
+	for (; i <= j; i++, j--)
+	  {
+	    int o = order[i];
+	    order[i] = order[j];
+	    order[j] = o;
+	    end_t e = in[i];
+	    in[i] = out[j];
+	    out[j] = e;
+	    if (i < j)
+	      {
+		e = in[j];
+		in[j] = out[i];
+		out[i] = e;
+	      }
+	    char r = rev[i];
+	    rev[i] = 1 - rev[j];
+	    rev[j] = 1 - r;
+	  }
+      }
+      void rotate (int i, int m, int j)
+      {				// move contours m to j-1 to go before contours i to m-1
+	reverse (i, m - 1);
+	reverse (m, j - 1);
+	reverse (i, j - 1);
+      }
+      struct timespec now, end;
+      clock_gettime (CLOCK_MONOTONIC, &end);
+      end.tv_sec += ms / 1000;
+      end.tv_nsec += ms % 1000 * 1000000L;
+      if (end.tv_nsec >= 1000000000L)
+	{
+	  end.tv_sec++;
+	  end.tv_nsec -= 1000000000L;
+	}
+      long double epsilon = 1;	// at least a unit better, so rounding cannot go round in circles
+      int better = 1;
+      while (better)
+	{
+	  better = 0;
+	  for (i = 0; i < n; i++)
+	    {
+	      clock_gettime (CLOCK_MONOTONIC, &now);
+	      if (now.tv_sec > end.tv_sec || (now.tv_sec == end.tv_sec && now.tv_nsec >= end.tv_nsec))
+		break;
+	      for (j = i; j < n; j++)
+		{		// 2-opt, reverse i to j
+		  long double was = dist (from (i), in[i]), is = dist (from (i), out[j]);
+		  if (j + 1 < n)
+		    {
+		      was += dist (out[j], in[j + 1]);
+		      is += dist (in[i], in[j + 1]);
+		    }
+		  if (is + epsilon < was)
+		    {
+		      reverse (i, j);
+		      better = 1;
+		    }
+		}
+	      int l;
+	      for (l = 1; l <= 3 && i + l <= n; l++)
+		{		// or-opt, move run of l contours from i, possibly reversed, to before contour j
+		  int e = i + l - 1;
+		  long double gain = dist (from (i), in[i]);
+		  if (e + 1 < n)
+		    gain += dist (out[e], in[e + 1]) - dist (from (i), in[e + 1]);
+		  for (j = 0; j <= n; j++)
+		    if (j < i || j > e + 1)
+		      {
+			end_t a = from (j);
+			long double cost = 0, rcost = 0;
+			if (j < n)
+			  {
+			    cost = dist (out[e], in[j]) - dist (a, in[j]);
+			    rcost = dist (in[i], in[j]) - dist (a, in[j]);
+			  }
+			cost += dist (a, in[i]);
+			rcost += dist (a, out[e]);
+			if (cost + epsilon < gain || rcost + epsilon < gain)
+			  {
+			    if (rcost < cost)
+			      reverse (i, e);
+			    if (j < i)
+			      rotate (j, i, e + 1);
+			    else
+			      rotate (i, e + 1, j);
+			    better = 1;
+			    break;
+			  }
+		      }
+		}
+	    }
+	}
+      for (i = 0; i < n; i++)
+	if (rev[i] && !list[order[i]]->dir)
+	  {			// run open path backwards, flag is for segment from vertex to next
+	    poly_vertex_t *v = list[order[i]]->vertices, *r = NULL;
+	    int flag = 0;
+	    while (v)
+	      {
+		poly_vertex_t *next = v->next;
+		int f = v->flag;
+		v->flag = flag;
+		flag = f;
+		v->next = r;
+		r = v;
+		v = next;
+	      }
+	    list[order[i]]->vertices = r;
+	  }
+      free (in);
+      free (out);
+      free (rev);
+      c = list[order[n - 1]];
+      poly_vertex_t *v;
+      for (v = c->vertices; v->next && !c->dir; v = v->next);
+      x = v->x;
+      y = v->y;
+    }
+  *empty = NULL;
+  for (i = n - 1; i >= 0; i--)
+    {
+      list[order[i]]->next = p->contours;
+      p->contours = list[order[i]];
     }
-  p->contours = n;
+  free (order);
+  free (list);
   if (xp)
     *xp = x;
   if (yp)
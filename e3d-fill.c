@@ -19,6 +19,8 @@
 #include <string.h>
 #include <err.h>
 #include <ctype.h>
+#include <stdlib.h>
+#include <limits.h>
 #include <malloc.h>
 
 #include "e3d-fill.h"
@@ -78,77 +80,224 @@ fill_perimeter (slice_t * slice, poly_dim_t width, int loops, int fast)
       return;
     }
   int l;
-  polygon_t *p[loops];
-  // work out the loops going in
-  polygon_t *q = poly_inset (slice->outline, width / 2);
+  polygon_t *p[loops + 1];
+  poly_dim_t d[loops + 1];
+  // work out the loops going in, all from the outline, and the fill inside them
   for (l = 0; l < loops; l++)
+    d[l] = width / 2 + width * l;
+  d[loops] = width * loops;
+  poly_inset_multi (slice->outline, d, loops + 1, p);
+  if (fast)
+    for (l = 1; l <= loops; l++)
+      poly_simplify (p[l], width / 10);	// inner surfaces need way less detail
+  slice->fill = p[loops];
+  // Each contour goes after the one already placed with the closest start point, earliest in order on a tie, so
+  // look up through a grid of start points rather than scanning all placed so far
+  typedef struct node_s node_t;
+  struct node_s
+  {
+    poly_contour_t *c;
+    unsigned long long label;	// increasing along the list, the grid key
+    int next;			// next in list, -1 for end
+  };
+  int n = 0, nodes = 0, head = -1;
+  poly_contour_t *c;
+  for (l = 0; l < loops; l++)
+    if (p[l])
+      for (c = p[l]->contours; c; c = c->next)
+	n++;
+  if (slice->extrude[EXTRUDE_PERIMETER])
+    for (c = slice->extrude[EXTRUDE_PERIMETER]->contours; c; c = c->next)
+      n++;
+  if (!n)
     {
-      p[l] = q;
-      q = poly_inset (q, (l + 1 < loops) ? width : width / 2);
-      if (fast)
-	poly_tidy (q, width / 10);	// inner surfaces need way less detail
+      for (l = 0; l < loops; l++)
+	poly_free (p[l]);
+      return;
+    }
+  node_t *node = mymalloc (n * sizeof (*node));
+  poly_dim_t minx = 0, miny = 0, maxx = 0, maxy = 0;
+  int boxed = 0;
+  void box (poly_contour_t * c)
+  {
+    poly_dim_t x = c->vertices->x, y = c->vertices->y;
+    if (!boxed++)
+      {
+	minx = maxx = x;
+	miny = maxy = y;
+	return;
+      }
+    minx = MIN (minx, x);
+    maxx = MAX (maxx, x);
+    miny = MIN (miny, y);
+    maxy = MAX (maxy, y);
+  }
+  for (l = 0; l < loops; l++)
+    if (p[l])
+      for (c = p[l]->contours; c; c = c->next)
+	box (c);
+  if (slice->extrude[EXTRUDE_PERIMETER])
+    for (c = slice->extrude[EXTRUDE_PERIMETER]->contours; c; c = c->next)
+      box (c);
+  grid_t *grid = grid_new (minx, miny, maxx, maxy, n, n);
+  int add (poly_contour_t * c, int after)
+  {				// add to grid, and to list after node after (-1 for at head)
+    node_t *a = node + nodes;
+    int i, next = (after < 0 ? head : node[after].next);
+    unsigned long long lo = (after < 0 ? 0 : node[after].label), hi = (next < 0 ? lo + (1ULL << 32) : node[next].label);
+    if (hi - lo < 2)
+      {				// no gap, relabel all
+	unsigned long long label = 0;
+	for (i = head; i >= 0; i = node[i].next)
+	  grid_key (grid, i, node[i].label = (label += (1ULL << 32)));
+	lo = (after < 0 ? 0 : node[after].label);
+	hi = (next < 0 ? lo + (1ULL << 32) : node[next].label);
+      }
+    a->c = c;
+    a->label = lo + (hi - lo) / 2;
+    grid_add (grid, nodes, c->vertices->x, c->vertices->y, a->label);
+    a->next = next;
+    if (after < 0)
+      head = nodes;
+    else
+      node[after].next = nodes;
+    return nodes++;
+  }
+  int last = -1;
+  if (slice->extrude[EXTRUDE_PERIMETER])
+    {				// already placed
+      for (c = slice->extrude[EXTRUDE_PERIMETER]->contours; c; c = c->next)
+	last = add (c, last);
+      slice->extrude[EXTRUDE_PERIMETER]->contours = NULL;
     }
-  slice->fill = q;
+  else
+    slice->extrude[EXTRUDE_PERIMETER] = poly_new ();
   // process loops in reverse order
   while (loops--)
     {				// add each contour - try to make them in order per contour
-      q = p[loops];
+      polygon_t *q = p[loops];
       if (!q)
 	continue;
-      poly_contour_t *c = q->contours;
-      if (c)
-	{
-	  q->contours = NULL;
-	  while (c)
-	    {
-	      poly_contour_t *next = c->next;
-	      c->next = NULL;
-	      polygon_t **pp = &slice->extrude[EXTRUDE_PERIMETER];
-	      if (!*pp)
-		{		// first contour
-		  *pp = poly_new ();
-		  (*pp)->contours = c;
-		}
-	      else
-		{		// find closest (by starting point) and append after it
-		  poly_contour_t *best = NULL, *z;
-		  poly_dim_t bestd = 0;
-		  for (z = (*pp)->contours; z; z = z->next)
-		    {
-		      poly_dim_t d =
-			sqrtl ((z->vertices->x - c->vertices->x) * (z->vertices->x - c->vertices->x) +
-			       (z->vertices->y - c->vertices->y) * (z->vertices->y - c->vertices->y));
-		      if (!best || d < bestd)
-			{
-			  best = z;
-			  bestd = d;
-			}
-		    }
-		  c->next = best->next;
-		  best->next = c;
-		}
-	      c = next;
-	    }
-	}
+      for (c = q->contours; c; c = c->next)
+	add (c, grid_nearest (grid, c->vertices->x, c->vertices->y));	// closest start, earliest on a tie
+      q->contours = NULL;
       poly_free (q);
     }
+  poly_contour_t **cc = &slice->extrude[EXTRUDE_PERIMETER]->contours;
+  for (l = head; l >= 0; l = node[l].next)
+    {
+      *cc = node[l].c;
+      cc = &node[l].c->next;
+    }
+  *cc = NULL;
+  grid_free (grid);
+  free (node);
+}
+
+typedef struct layers_s layers_t;
+struct layers_s
+{				// Layers to work on in parallel
+  stl_t *stl;
+  int count;
+  slice_t **slice;		// each layer, in order
+  poly_dim_t width;
+  int loops0, loops, altloops, fast;
+  double density, fillflow;
+  int layers;			// solid layers either side
+  int *start;			// first layer of each block, and count at end
+  int *added, *backs;		// layers added to window, and how many in back, at start of each block
+  int borders;			// outlines being unioned in pairs
+  polygon_t **from, **to;
+  int owned;			// from are ours to free, not layer outlines
+};
+
+static void
+layers_start (layers_t * l, stl_t * stl)
+{
+  slice_t *s;
+  l->stl = stl;
+  l->count = 0;
+  for (s = stl->slices; s; s = s->next)
+    l->count++;
+  l->slice = mymalloc (l->count * sizeof (*l->slice) + 1);
+  l->count = 0;
+  for (s = stl->slices; s; s = s->next)
+    l->slice[l->count++] = s;
+}
+
+static void
+perimeter_layer (void *arg, int n)
+{
+  layers_t *l = arg;
+  if (!n)
+    fill_perimeter (l->slice[n], l->width, l->loops0, 0);
+  else
+    fill_perimeter (l->slice[n], l->width, l->loops + ((n & 1) ? l->altloops : 0), l->fast);
 }
 
 void
-fill_area (stl_t * stl, poly_dim_t width, int layers)
-{				// work out types of fill area based on layers
+fill_perimeters (stl_t * stl, poly_dim_t width, int loops0, int loops, int altloops, int fast)
+{				// Each layer only needs its own slice, so done in parallel
+  layers_t l = {.width = width,.loops0 = loops0,.loops = loops,.altloops = altloops,.fast = fast };
+  layers_start (&l, stl);
+  parallel (l.count, perimeter_layer, &l);
+  free (l.slice);
+}
+
+static void
+area_block (void *arg, int b)
+{				// work out types of fill area based on layers, for one block of layers
+  layers_t *l = arg;
   polygon_t *p, *q;
-  slice_t *prev = NULL, *base = stl->slices, *s;
-  int count = 0;
-  for (s = stl->slices; s; s = s->next)
+  poly_dim_t width = l->width;
+  int layers = l->layers, count = l->start[b];
+  // Intersection of fills over a sliding window of layers, as a queue made of two stacks, so each layer costs a few
+  // intersections however many layers. Back has the newest fills and their intersection, front has the oldest, each
+  // with the intersection of it and all newer in front. Blocks start where back is moved to front, so do the same
+  // intersections as one serial run.
+  int window = layers * 2 + 1, backs = l->backs[b], fronts = 0;
+  int known = !backs;		// what is in back is only counted until it is moved to front
+  polygon_t *back = NULL;	// intersection of fills in back
+  polygon_t *front[window + 1];	// one more as new layer is added before oldest is dropped
+  int added = l->added[b];	// layers added to the window, so next to add
+  int oldest = added - backs;	// oldest in window
+  void push (polygon_t * fill)
+  {
+    if (!known)
+      {
+	backs++;
+	return;
+      }
+    polygon_t *b = (backs++ ? poly_clip (POLY_ALL, 2, back, fill) : poly_clip (POLY_UNION, 1, fill));
+    poly_free (back);
+    back = b;
+  }
+  void pop (void)
+  {
+    if (!fronts)
+      {				// move back to front, newest first
+	int n;
+	for (n = backs; n > 0; n--)
+	  {
+	    polygon_t *f = l->slice[oldest + n - 1]->fill;
+	    front[fronts] = (fronts ? poly_clip (POLY_ALL, 2, front[fronts - 1], f) : poly_clip (POLY_UNION, 1, f));
+	    fronts++;
+	  }
+	backs = 0;
+	poly_free (back);
+	back = NULL;
+	known = 1;
+      }
+    poly_free (front[--fronts]);
+    oldest++;
+  }
+  for (; count < l->start[b + 1]; count++)
     {
-      q = poly_clip (POLY_UNION, 2, stl->border, s->outline);
-      poly_free (stl->border);
-      stl->border = q;
+      slice_t *s = l->slice[count];
       // flying layers
-      if (prev)
+      if (count)
 	{
-	  p = poly_sub (s->fill, prev->outline);
+	  p = poly_sub (s->fill, l->slice[count - 1]->outline);
 	  q = poly_inset (p, -width * 2);
 	  poly_free (p);
 	  p = poly_clip (POLY_INTERSECT, 2, s->fill, q);
@@ -159,24 +308,19 @@ fill_area (stl_t * stl, poly_dim_t width, int layers)
       // union of fill from adjacent layers
       p = NULL;
       if (count >= layers)
-	{
-	  p = poly_clip (POLY_UNION, 1, s->fill);
-	  int n = layers * 2 + 1;
-	  slice_t *l = base;
-	  while (l && n-- > 0)
+	{			// window of layers count-layers to count+layers
+	  while (added < l->count && added < count + layers + 1)
+	    push (l->slice[added++]->fill);
+	  if (added == count + layers + 1)
 	    {
-	      if (l != s)
-		{
-		  q = poly_clip (POLY_INTERSECT, 2, l->fill, p);
-		  poly_free (p);
-		  p = q;
-		}
-	      l = l->next;
-	    }
-	  if (n > 0)
-	    {
-	      poly_free (p);
-	      p = NULL;
+	      if (added > window)
+		pop ();
+	      if (!fronts)
+		p = poly_clip (POLY_UNION, 1, back);
+	      else if (!backs)
+		p = poly_clip (POLY_UNION, 1, front[fronts - 1]);
+	      else
+		p = poly_clip (POLY_ALL, 2, front[fronts - 1], back);
 	    }
 	}
       q = poly_sub (s->fill, p);
@@ -195,11 +339,404 @@ fill_area (stl_t * stl, poly_dim_t width, int layers)
       q = poly_sub (s->fill, s->solid);
       s->infill = poly_sub (q, s->flying);
       poly_free (q);
-      prev = s;
-      if (count >= layers)
-	base = base->next;
-      count++;
     }
+  while (fronts)
+    poly_free (front[--fronts]);
+  poly_free (back);
+}
+
+static void
+border_pair (void *arg, int n)
+{				// union of a pair of outlines, or just one at the end
+  layers_t *l = arg;
+  if (n * 2 + 1 < l->borders)
+    l->to[n] = poly_clip (POLY_UNION, 2, l->from[n * 2], l->from[n * 2 + 1]);
+  else
+    l->to[n] = poly_clip (POLY_UNION, 1, l->from[n * 2]);
+  if (l->owned)
+    {
+      poly_free (l->from[n * 2]);
+      if (n * 2 + 1 < l->borders)
+	poly_free (l->from[n * 2 + 1]);
+    }
+}
+
+void
+fill_area (stl_t * stl, poly_dim_t width, int layers)
+{				// work out types of fill area based on layers
+  layers_t l = {.width = width,.layers = layers };
+  layers_start (&l, stl);
+  int n;
+  // Total outline, as a balanced tree of unions so no one sweep is of more than two layers' worth, each level in parallel
+  l.from = mymalloc ((l.count + 1) * sizeof (*l.from));
+  l.to = mymalloc ((l.count + 1) * sizeof (*l.to));
+  for (n = 0; n < l.count; n++)
+    l.from[l.borders++] = l.slice[n]->outline;
+  if (stl->border)
+    l.from[l.borders++] = stl->border;
+  while (l.borders > 1 || (l.borders && !l.owned))
+    {
+      int pairs = (l.borders + 1) / 2;
+      parallel (pairs, border_pair, &l);
+      if (!l.owned && stl->border)
+	poly_free (stl->border);
+      polygon_t **t = l.from;
+      l.from = l.to;
+      l.to = t;
+      l.borders = pairs;
+      l.owned = 1;
+    }
+  if (l.borders)
+    stl->border = l.from[0];
+  free (l.from);
+  free (l.to);
+  // Each layer only reads fills and outlines, so done in parallel in blocks, each starting where the window queue
+  // moves back to front, found by running the queue on counts alone
+  l.start = mymalloc ((l.count + 2) * sizeof (*l.start));
+  l.added = mymalloc ((l.count + 1) * sizeof (*l.added));
+  l.backs = mymalloc ((l.count + 1) * sizeof (*l.backs));
+  int window = layers * 2 + 1, added = 0, backs = 0, fronts = 0, blocks = 1, count;
+  for (count = 0; count < l.count; count++)
+    if (count >= layers)
+      {
+	int a = added, b = backs;
+	while (added < l.count && added < count + layers + 1)
+	  {
+	    added++;
+	    backs++;
+	  }
+	if (added == count + layers + 1 && added > window)
+	  {
+	    if (!fronts)
+	      {			// new block
+		l.start[blocks] = count;
+		l.added[blocks] = a;
+		l.backs[blocks++] = b;
+		fronts = backs;
+		backs = 0;
+	      }
+	    fronts--;
+	  }
+      }
+  l.start[blocks] = l.count;
+  if (l.count)
+    parallel (blocks, area_block, &l);
+  free (l.start);
+  free (l.added);
+  free (l.backs);
+  free (l.slice);
+}
+
+static int
+hatch_closed (const void *ap, const void *bp)
+{				// contours by the start point poly_clip closes them at, right to left and top to bottom
+  const poly_vertex_t *a = (*(poly_contour_t * const *) ap)->vertices, *b = (*(poly_contour_t * const *) bp)->vertices;
+  if (a->x != b->x)
+    return a->x > b->x ? -1 : 1;
+  if (a->y != b->y)
+    return a->y > b->y ? -1 : 1;
+  return 0;
+}
+
+static polygon_t *
+hatch (polygon_t * q, int rise, poly_dim_t u0, poly_dim_t du, poly_dim_t iu)
+{				// Strips from u0+k*du to u0+k*du+iu across q, u being y-x if rise else y+x, flagged 1 along bottom and 2 along top
+  // Makes the contours poly_clip (POLY_INTERSECT) of q and the strips would, but directly from the crossings of each strip line
+  // with the edges of q, found by walking the lines over an edge table sorted by lowest line, so cost is only the area filled
+  polygon_t *p = poly_new ();
+  typedef struct edge_s edge_t;
+  struct edge_s
+  {				// edge from vertex to next vertex in contour
+    poly_dim_t x, y, u;
+    int next, prev;		// vertices either side in contour
+    int first, lines;		// lines crossed
+    int cross;			// crossing for first line
+  };
+  typedef struct cross_s cross_t;
+  struct cross_s
+  {				// crossing of a line by an edge
+    poly_dim_t x, y;
+    int edge, line;
+    int pair;			// crossing at other end of inside part of line, -1 if none
+    char used;
+  };
+  int edges = 0, crosses = 0, lines, e, m, i;
+  poly_contour_t *c;
+  poly_vertex_t *v;
+  for (c = q->contours; c; c = c->next)
+    for (v = c->vertices; v; v = v->next)
+      edges++;
+  if (!edges)
+    return p;
+  edge_t *edge = mymalloc (edges * sizeof (*edge));
+  poly_dim_t umin = POLY_DIM_MAX, umax = -POLY_DIM_MAX;
+  e = 0;
+  for (c = q->contours; c; c = c->next)
+    if (c->vertices)
+      {
+	int start = e;
+	for (v = c->vertices; v; v = v->next)
+	  {
+	    edge[e].x = v->x;
+	    edge[e].y = v->y;
+	    edge[e].u = (rise ? v->y - v->x : v->y + v->x);
+	    umin = MIN (umin, edge[e].u);
+	    umax = MAX (umax, edge[e].u);
+	    edge[e].next = e + 1;
+	    edge[e].prev = e - 1;
+	    e++;
+	  }
+	edge[e - 1].next = start;
+	edge[start].prev = e - 1;
+      }
+  inline poly_dim_t strip (poly_dim_t u)
+  {				// strip whose bottom line is at or below u
+    return (u - u0 < 0 ? -((u0 - u + du - 1) / du) : (u - u0) / du);
+  }
+  // line 2n is bottom and 2n+1 top of strip kmin+n
+  poly_dim_t kmin = strip (umin) - 1;
+  lines = 2 * (strip (umax) - kmin + 2);
+  inline poly_dim_t line_u (int m)
+  {
+    return u0 + (kmin + m / 2) * du + ((m & 1) ? iu : 0);
+  }
+  inline int line_above (poly_dim_t u)
+  {				// first line above u
+    poly_dim_t k = strip (u);
+    return 2 * (k - kmin) + (u < u0 + k * du + iu ? 1 : 2);
+  }
+  inline int crossing (int e, int m)
+  {				// crossing of line m by edge e, or -1 if none, a vertex on a line counting as above it
+    return (m >= edge[e].first && m < edge[e].first + edge[e].lines) ? edge[e].cross + m - edge[e].first : -1;
+  }
+  typedef struct table_s table_t;
+  struct table_s
+  {				// edge table entry
+    int first, edge;
+  };
+  for (e = 0; e < edges; e++)
+    {				// a vertex under a unit from a line is taken as on it, as poly_clip snaps the line to it
+      poly_dim_t u = edge[e].u;
+      m = line_above (u);
+      if (line_u (m) - u == 1)
+	edge[e].u = line_u (m);
+      else if (u - line_u (m - 1) == 1)
+	edge[e].u = line_u (m - 1);
+    }
+  table_t *table = mymalloc (edges * sizeof (*table));
+  int tables = 0;
+  for (e = 0; e < edges; e++)
+    {
+      poly_dim_t a = edge[e].u, b = edge[edge[e].next].u;
+      edge[e].first = line_above (MIN (a, b));
+      edge[e].lines = line_above (MAX (a, b)) - edge[e].first;
+      edge[e].cross = crosses;
+      crosses += edge[e].lines;
+      if (edge[e].lines)
+	{
+	  table[tables].first = edge[e].first;
+	  table[tables++].edge = e;
+	}
+    }
+  int lowest (const void *ap, const void *bp)
+  {
+    const table_t *a = ap, *b = bp;
+    if (a->first != b->first)
+      return a->first - b->first;
+    return a->edge - b->edge;
+  }
+  qsort (table, tables, sizeof (*table), lowest);
+  cross_t *cross = mymalloc (crosses * sizeof (*cross) + 1);
+  typedef struct order_s order_t;
+  struct order_s
+  {				// crossing in order along a line
+    long double t;		// exact X
+    poly_dim_t dx, du;		// direction of edge, upwards
+    int cross;
+  };
+  order_t *order = mymalloc (crosses * sizeof (*order) + 1);	// crossings along each line, line m from start[m] to start[m+1]-1
+  int *start = mymalloc ((lines + 1) * sizeof (*start));
+  int *active = mymalloc (tables * sizeof (*active) + 1), actives = 0, next = 0, n = 0;
+  int along (const void *ap, const void *bp)
+  {
+    const order_t *a = ap, *b = bp;
+    if (a->t != b->t)
+      return a->t < b->t ? -1 : 1;
+    // same point, so order by X just below the line
+    poly_dim_t d = a->dx * b->du - b->dx * a->du;
+    if (d)
+      return d > 0 ? -1 : 1;
+    return a->cross - b->cross;
+  }
+  for (m = 0; m < lines; m++)
+    {				// scan lines, pairing crossings along each to find the parts inside q
+      start[m] = n;
+      int o = 0;
+      for (i = 0; i < actives; i++)
+	if (edge[active[i]].first + edge[active[i]].lines > m)	// drop those now below, keeping order
+	  active[o++] = active[i];
+      actives = o;
+      while (next < tables && table[next].first <= m)
+	active[actives++] = table[next++].edge;
+      poly_dim_t u = line_u (m);
+      for (i = 0; i < actives; i++)
+	{
+	  edge_t *a = edge + active[i], *b = edge + a->next;
+	  cross_t *k = cross + crossing (active[i], m);
+	  order_t *o = order + n++;
+	  o->t = a->x + (b->x - a->x) * ((long double) (u - a->u) / (b->u - a->u));
+	  o->dx = (b->u > a->u ? b->x - a->x : a->x - b->x);
+	  o->du = (b->u > a->u ? b->u - a->u : a->u - b->u);
+	  o->cross = k - cross;
+	  k->x = llroundl (o->t);
+	  k->y = (rise ? u + k->x : u - k->x);
+	  if (u == a->u)
+	    k->y = a->y;	// at a vertex
+	  else if (u == b->u)
+	    k->y = b->y;
+	  k->edge = active[i];
+	  k->line = m;
+	  k->pair = -1;
+	}
+      qsort (order + start[m], n - start[m], sizeof (*order), along);
+      for (i = start[m]; i + 1 < n; i += 2)
+	{
+	  cross[order[i].cross].pair = order[i + 1].cross;
+	  cross[order[i + 1].cross].pair = order[i].cross;
+	}
+    }
+  start[lines] = n;
+  // trace round each part of each strip, clockwise as poly_clip makes, bottom line right to left and top left to right
+  int maxpoints = 0, points = 0;
+  poly_dim_t *px = NULL, *py = NULL;
+  int *pf = NULL;
+  void add (poly_dim_t x, poly_dim_t y, int flag)
+  {
+    if (points && px[points - 1] == x && py[points - 1] == y)
+      {				// same point, so next segment from it
+	pf[points - 1] = flag;
+	return;
+      }
+    if (points == maxpoints)
+      {
+	maxpoints += 64;
+	px = realloc (px, maxpoints * sizeof (*px));
+	py = realloc (py, maxpoints * sizeof (*py));
+	pf = realloc (pf, maxpoints * sizeof (*pf));
+	if (!px || !py || !pf)
+	  errx (1, "malloc");
+      }
+    px[points] = x;
+    py[points] = y;
+    pf[points] = flag;
+    points++;
+  }
+  void contour (int dir)
+  {				// output points as a contour
+    if (points > 1 && px[points - 1] == px[0] && py[points - 1] == py[0])
+      points--;
+    long long area = 0;
+    int j;
+    for (j = 0; j < points; j++)
+      area += px[j] * py[(j + 1) % points] - px[(j + 1) % points] * py[j];
+    if (points >= 3 && area)
+      {
+	int r = 0;		// start at the rightmost point, lowest first, where poly_clip closes it
+	for (j = 1; j < points; j++)
+	  if (px[j] > px[r] || (px[j] == px[r] && py[j] < py[r]))
+	    r = j;
+	poly_start (p);
+	for (j = 0; j < points; j++)
+	  poly_add (p, px[(r + j) % points], py[(r + j) % points], pf[(r + j) % points]);
+	p->contours->dir = (dir ? : area < 0 ? 1 : -1);
+      }
+    points = 0;
+  }
+  for (m = 0; m < lines; m += 2)
+    {				// strip from line m to m+1
+      int l;
+      for (l = m; l <= m + 1; l++)
+	for (i = start[l] + (l == m); i < start[l + 1]; i += 2)
+	  {			// each part not yet traced, starting from its right end on the bottom, or left on the top
+	    int s = order[i].cross, k = s;
+	    if (cross[s].used || cross[s].pair < 0)
+	      continue;
+	    do
+	      {
+		cross_t *a = cross + k, *b = cross + a->pair;
+		a->used = b->used = 1;
+		add (a->x, a->y, a->line == m ? 1 : 2);
+		add (b->x, b->y, 0);
+		// follow edge of q from b into the strip to where it next meets a line
+		int up = (b->line == m);
+		e = b->edge;
+		int forward = ((edge[edge[e].next].u > edge[e].u) == up);
+		k = crossing (e, up ? m + 1 : m);
+		while (k < 0)
+		  {
+		    if (forward)
+		      {
+			e = edge[e].next;
+			add (edge[e].x, edge[e].y, 0);
+		      }
+		    else
+		      {
+			add (edge[e].x, edge[e].y, 0);
+			e = edge[e].prev;
+		      }
+		    if ((k = crossing (e, m)) < 0)
+		      k = crossing (e, m + 1);
+		  }
+	      }
+	    while (k != s && !cross[k].used && cross[k].pair >= 0);
+	    contour (0);
+	  }
+    }
+  // contours of q not crossing any line, inside a strip
+  e = 0;
+  for (c = q->contours; c; c = c->next)
+    if (c->vertices)
+      {
+	int first = e, crossed = 0;
+	for (v = c->vertices; v; v = v->next)
+	  crossed += edge[e++].lines;
+	if (!crossed && (line_above (edge[first].u) & 1))
+	  {
+	    for (v = c->vertices; v; v = v->next)
+	      add (v->x, v->y, 0);
+	    contour (c->dir);
+	  }
+      }
+  free (px);
+  free (py);
+  free (pf);
+  free (active);
+  free (start);
+  free (order);
+  free (cross);
+  free (table);
+  free (edge);
+  poly_tidy (p, 0);
+  {				// order as poly_clip closes them, last to close first
+    int n = 0;
+    for (c = p->contours; c; c = c->next)
+      n++;
+    if (n > 1)
+      {
+	poly_contour_t **list = mymalloc (n * sizeof (*list)), **cp = &p->contours;
+	for (n = 0, c = p->contours; c; c = c->next)
+	  list[n++] = c;
+	qsort (list, n, sizeof (*list), hatch_closed);
+	for (i = 0; i < n; i++)
+	  {
+	    *cp = list[i];
+	    cp = &list[i]->next;
+	  }
+	*cp = NULL;
+	free (list);
+      }
+  }
+  return p;
 }
 
 static void
@@ -210,7 +747,7 @@ fill (int e, stl_t * s, slice_t * a, polygon_t * p, int dir, poly_dim_t width, d
   if (!p || !p->contours)
     return;
   polygon_t *q = poly_inset (p, width / 2);
-  poly_dim_t w = s->max.x - s->min.x, y, d = width * sqrtl (2.0), dy = d * 2.0, iy = dy - d;
+  poly_dim_t w = s->max.x - s->min.x, d = width * sqrtl (2.0), dy = d * 2.0, iy = dy - d;
   int passes = 1, pass;
   if (density < 1)
     {				// sparse fill
@@ -221,34 +758,16 @@ fill (int e, stl_t * s, slice_t * a, polygon_t * p, int dir, poly_dim_t width, d
   if (density < 1)	// only for sparse as still not joining up correctly, arrrg
     passes = 2;
   for (pass = 0; pass < passes; pass++)
-    {
-      polygon_t *n = poly_new ();
-      for (y = s->min.y - w; y < s->max.y + dy; y += dy)
-	{			// fill pattern
-	  poly_start (n);
-	  poly_dim_t oy = y + (d * dir / 4 + (((dir / 2) % 2) * dy / 2)) % dy, iiy = iy;
-	  if (pass)
-	    {			// other phase
-	      poly_dim_t ny = oy + dy;
-	      oy += iy;
-	      iiy = ny - oy;
-	    }
-	  if (dir & 1)
-	    {
-	      poly_add (n, s->min.x, oy, 1);
-	      poly_add (n, s->min.x, oy + iiy, 2);
-	      poly_add (n, s->max.x, oy + w + iiy, 1);
-	      poly_add (n, s->max.x, oy + w, 1);
-	    }
-	  else
-	    {
-	      poly_add (n, s->max.x, oy, 1);
-	      poly_add (n, s->min.x, oy + w, 1);
-	      poly_add (n, s->min.x, oy + w + iiy, 2);
-	      poly_add (n, s->max.x, oy + iiy, 1);
-	    }
+    {				// fill pattern, laid out over the whole model so it lines up, but only made where the area is
+      poly_dim_t oy = s->min.y - w + (d * dir / 4 + (((dir / 2) % 2) * dy / 2)) % dy, iiy = iy;
+      if (pass)
+	{			// other phase
+	  poly_dim_t ny = oy + dy;
+	  oy += iy;
+	  iiy = ny - oy;
 	}
-      polygon_t *p = poly_clip (POLY_INTERSECT, 2, n, q);
+      // strips rise (or fall) one for one with X across the model from oy at the side
+      polygon_t *p = hatch (q, dir & 1, oy + ((dir & 1) ? -s->min.x : s->max.x), dy, iiy);
       if (passes > 1)
 	{			// clipping out parts to we make more of a zig-zag for sparse fills
 	  poly_contour_t *c, **cp = &p->contours;
@@ -335,39 +854,61 @@ fill (int e, stl_t * s, slice_t * a, polygon_t * p, int dir, poly_dim_t width, d
 	    }
 	}
       prefix_extrude (&a->extrude[e], p);
-      poly_free (n);
     }
   if (passes > 1 && a->extrude[e])
     {				// join the dots
-      poly_contour_t *c, **cp = &a->extrude[e]->contours;
-      while ((c = *cp))
+      poly_contour_t *c, **cp;
+      // open contours indexed by start point, each hash chain in list order
+      int count = 0, bits = 4, i, j;
+      for (c = a->extrude[e]->contours; c; c = c->next)
+	count++;
+      while ((1 << bits) < count * 2)
+	bits++;
+      poly_contour_t **list = mymalloc (count * sizeof (*list));
+      int *head = mymalloc ((1 << bits) * sizeof (*head));
+      int *next = mymalloc (count * sizeof (*next));
+      inline unsigned int hash (poly_dim_t x, poly_dim_t y)
+      {
+	return ((unsigned long long) x * 0x9E3779B97F4A7C15ULL ^ (unsigned long long) y * 0xC2B2AE3D27D4EB4FULL) >> (64 - bits);
+      }
+      memset (head, -1, (1 << bits) * sizeof (*head));
+      for (i = 0, c = a->extrude[e]->contours; c; c = c->next)
+	list[i++] = c;
+      for (i = count - 1; i >= 0; i--)
+	if (!list[i]->dir && list[i]->vertices)
+	  {
+	    unsigned int h = hash (list[i]->vertices->x, list[i]->vertices->y);
+	    next[i] = head[h];
+	    head[h] = i;
+	  }
+      for (i = 0; i < count; i++)
 	{
+	  c = list[i];
 	  if (!c->dir)
 	    {			// open ended
 	      poly_vertex_t *v, *f = NULL;
 	      for (f = c->vertices; f && f->next; f = f->next);
-	      if (f)
+	      int from = 0;	// first look from start of list, then from this one on
+	      while (f)
 		{		// see if anything tacks on the end of this
-		  poly_contour_t *c2, **cp2 = &a->extrude[e]->contours;
-		  while ((c2 = *cp2))
-		    {
-		      if (c != c2 && !c2->dir && (v = c2->vertices) && v->x == f->x && v->y == f->y)
-			{	// found one
-			  f->flag = v->flag;
-			  f->next = v->next;
-			  free (v);
-			  c2->vertices = NULL;
-			  while (f->next)
-			    f = f->next;
-			  cp2 = cp;
-			  continue;
-			}
-		      cp2 = &c2->next;
-		    }
+		  for (j = head[hash (f->x, f->y)]; j >= 0; j = next[j])
+		    if (j >= from && j != i && (v = list[j]->vertices) && v->x == f->x && v->y == f->y)
+		      break;
+		  if (j < 0)
+		    break;
+		  f->flag = v->flag;
+		  f->next = v->next;
+		  free (v);
+		  list[j]->vertices = NULL;
+		  while (f->next)
+		    f = f->next;
+		  from = i;
 		}
 	    }
-	  cp = &c->next;
 	}
+      free (list);
+      free (head);
+      free (next);
       // clean up
       cp = &a->extrude[e]->contours;
       while ((c = *cp))
@@ -384,27 +925,55 @@ fill (int e, stl_t * s, slice_t * a, polygon_t * p, int dir, poly_dim_t width, d
   poly_free (q);
 }
 
+static void
+extrude_layer (void *arg, int layer)
+{
+  layers_t *l = arg;
+  stl_t *s = l->stl;
+  slice_t *a = l->slice[layer];
+  poly_dim_t width = l->width;
+  fill (EXTRUDE_FILL, s, a, a->infill, layer, width, l->density, l->fillflow);
+  fill (EXTRUDE_FILL, s, a, a->solid, layer, width, 1, 1);
+  // flying layer done differently - outside in plot
+  if (a->flying && a->flying->contours)
+    {				// loops can go no further in than half the narrower side of the bounding box
+      poly_dim_t minx = 0, maxx = 0, miny = 0, maxy = 0;
+      int first = 1, loops, l;
+      poly_contour_t *c;
+      poly_vertex_t *v;
+      for (c = a->flying->contours; c; c = c->next)
+	for (v = c->vertices; v; v = v->next)
+	  {
+	    if (first || v->x < minx)
+	      minx = v->x;
+	    if (first || v->x > maxx)
+	      maxx = v->x;
+	    if (first || v->y < miny)
+	      miny = v->y;
+	    if (first || v->y > maxy)
+	      maxy = v->y;
+	    first = 0;
+	  }
+      loops = (maxx - minx < maxy - miny ? maxx - minx : maxy - miny) / 2 / width + 2;
+      poly_dim_t d[loops];
+      polygon_t *q[loops];
+      for (l = 0; l < loops; l++)
+	d[l] = width / 2 + width * l;
+      poly_inset_multi (a->flying, d, loops, q);
+      for (l = 0; l < loops && q[l]->contours; l++)
+	append_extrude (&a->extrude[EXTRUDE_FLYING], q[l]);
+      for (; l < loops; l++)
+	poly_free (q[l]);
+    }
+}
+
 void
 fill_extrude (stl_t * s, poly_dim_t width, double density, double fillflow)
-{				// Generate extrude path for fills
-  int layer = 0;
-  slice_t *a;
-  for (a = s->slices; a; a = a->next)
-    {
-      fill (EXTRUDE_FILL, s, a, a->infill, layer, width, density, fillflow);
-      fill (EXTRUDE_FILL, s, a, a->solid, layer, width, 1, 1);
-      // flying layer done differently - outside in plot
-      polygon_t *q = poly_inset (a->flying, width / 2);
-      while (q && q->contours)
-	{
-	  polygon_t *n = poly_inset (q, width);
-	  append_extrude (&a->extrude[EXTRUDE_FLYING], q);
-	  q = n;
-	}
-      if (q && !q->contours)
-	poly_free (q);
-      layer++;
-    }
+{				// Generate extrude path for fills, each layer only needs its own slice, so done in parallel
+  layers_t l = {.width = width,.density = density,.fillflow = fillflow };
+  layers_start (&l, s);
+  parallel (l.count, extrude_layer, &l);
+  free (l.slice);
 }
 
 void
@@ -475,16 +1044,19 @@ fill_anchor (stl_t * stl, int loops, poly_dim_t width, poly_dim_t offset, poly_d
     }
   else
     p = ol;			// ol2 not set so no need to free it
-  polygon_t *next = poly_inset (p, -width);
+  polygon_t *loop[loops + 1];
+  poly_dim_t d[loops + 1];
+  int l;
+  for (l = 0; l <= loops; l++)
+    d[l] = -width * (l + 1);
+  poly_inset_multi (p, d, loops + 1, loop);
   poly_free (p);
-  p = next;
-  while (loops--)
+  for (l = 0; l < loops; l++)
     {				// add the layers
-      next = poly_inset (p, -width);
-      poly_tidy (p, width / 8);
-      prefix_extrude (&stl->anchor, p);
-      p = next;
+      poly_tidy (loop[l], width / 8);
+      prefix_extrude (&stl->anchor, loop[l]);
     }
+  p = loop[loops];
   polygon_t *q = poly_clip (POLY_UNION, 2, stl->border, p);
   poly_free (p);
   poly_free (stl->border);
@@ -17,6 +17,7 @@
 #include "e3d.h"
 
 void fill_perimeter (slice_t *, poly_dim_t width, int loops, int fast);	// create perimeter and remaining fill area
+void fill_perimeters (stl_t * stl, poly_dim_t width, int loops0, int loops, int altloops, int fast);	// fill_perimeter for all layers, loops0 on layer 0, altloops extra on odd layers
 void fill_area (stl_t * stl, poly_dim_t width, int layers);	// Break down fill areas based on layers
 void fill_extrude (stl_t * stl, poly_dim_t width, double density,double fillflow);	// Generate extrude path for fills
 void fill_anchor (stl_t * stl, int loops, poly_dim_t width, poly_dim_t offset, poly_dim_t step);	// Add anchor to layer 0
@@ -19,12 +19,14 @@
 #include <string.h>
 #include <err.h>
 #include <ctype.h>
+#include <time.h>
 
 #include "e3d-gcode.h"
 
 unsigned int
 gcode_out (const char *filename, stl_t * stl, double flowrate, poly_dim_t layer, poly_dim_t speed0, poly_dim_t speed, poly_dim_t zspeed, double back,
-	   poly_dim_t hop, int mirror, double anchorflow, double fillflow, int eplaces, int tempbed, int temp0, int temp, int quiet)
+	   poly_dim_t hop, int mirror, double anchorflow, double fillflow, int eplaces, int tempbed, int temp0, int temp, int quiet,
+	   int travel)
 {				// returns time estimate in seconds
   FILE *o = fopen (filename, "w");
   if (!o)
@@ -147,10 +149,19 @@ gcode_out (const char *filename, stl_t * stl, double flowrate, poly_dim_t layer,
       int e;
       plot_loops (s->extrude[EXTRUDE_PERIMETER], sp, flowrate, 1);
       plot_loops (s->extrude[EXTRUDE_PERIMETER], sp, flowrate, -1);
+      struct timespec start, now;
+      clock_gettime (CLOCK_MONOTONIC, &start);
       for (e = EXTRUDE_PERIMETER + 1; e < EXTRUDE_PATHS - 1; e++)
-	{
+	{			// one travel budget per layer, shared by what is left of it
 	  poly_dim_t x = px, y = py;
-	  poly_order (s->extrude[e], &x, &y);
+	  int left = travel;
+	  if (travel)
+	    {
+	      clock_gettime (CLOCK_MONOTONIC, &now);
+	      left -= (now.tv_sec - start.tv_sec) * 1000 + (now.tv_nsec - start.tv_nsec) / 1000000;
+	      left = (left > 0 ? left / (EXTRUDE_PATHS - 1 - e) : 0);
+	    }
+	  poly_order (s->extrude[e], &x, &y, left);
 	  plot_loops (s->extrude[e], sp, flowrate, 0);
 	}
       plot_loops (s->extrude[e], speed0, flowrate, -1);	// flying layer - in order it was made
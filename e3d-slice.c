@@ -23,33 +23,107 @@
 #include <malloc.h>
 
 #include "e3d-slice.h"
+#include "e3d-stl.h"
 
 //#define       DEBUG
 
-slice_t *
-slice (stl_t * stl, poly_dim_t z, poly_dim_t tolerance)
+typedef struct sweep_s sweep_t;
+struct sweep_s
+{				// Sweep up through Z index, tracking facets that cross current Z
+  stl_t *stl;
+  int next;			// next in zindex to consider
+  int count;			// active facets
+  stl_zindex_t **active;	// in facet order
+  stl_zindex_t **add;		// scratch for facets being added
+  int *segment;			// segment for each facet, -1 if none
+};
+
+static int
+sweep_order (const void *a, const void *b)
 {
+  return (*(stl_zindex_t **) a)->facet - (*(stl_zindex_t **) b)->facet;
+}
+
+static void
+sweep_to (sweep_t * s, poly_dim_t z)
+{				// move sweep up to z, active facets have lowest Z<=z and highest Z>z
+  stl_t *stl = s->stl;
+  int n = 0, i, o = 0;
+  for (i = 0; i < s->count; i++)
+    if (s->active[i]->max > z)	// drop those now below, keeping order
+      s->active[o++] = s->active[i];
+  s->count = o;
+  while (s->next < stl->count && stl->zindex[s->next].min <= z)
+    {
+      if (stl->zindex[s->next].max > z)
+	s->add[n++] = stl->zindex + s->next;
+      s->next++;
+    }
+  if (!n)
+    return;
+  qsort (s->add, n, sizeof (*s->add), sweep_order);
+  // merge, from the end
+  i = s->count;
+  o = s->count + n;
+  s->count = o;
+  while (n)
+    {
+      if (i && s->active[i - 1]->facet > s->add[n - 1]->facet)
+	s->active[--o] = s->active[--i];
+      else
+	s->active[--o] = s->add[--n];
+    }
+}
+
+static void
+sweep_start (sweep_t * s, stl_t * stl)
+{
+  memset (s, 0, sizeof (*s));
+  s->stl = stl;
+  s->active = mymalloc (stl->count * sizeof (*s->active) + 1);
+  s->add = mymalloc (stl->count * sizeof (*s->add) + 1);
+  s->segment = mymalloc (stl->count * sizeof (*s->segment) + 1);
+  memset (s->segment, -1, stl->count * sizeof (*s->segment));
+}
+
+static void
+sweep_end (sweep_t * s)
+{
+  free (s->active);
+  free (s->add);
+  free (s->segment);
+}
+
+static slice_t *
+slice_sweep (sweep_t * sweep, poly_dim_t z, poly_dim_t tolerance)
+{				// Slice at z, sweep must be at z
+  stl_t *stl = sweep->stl;
   poly_dim_t tolerance2 = tolerance * tolerance;
-  // Extract 2D line segments
+  // Extract 2D line segments, one per facet crossing z
   typedef struct segment_s segment_t;
   struct segment_s
   {
-    segment_t *next, **prev;
+    int facet;			// facet it came from
+    int edge[2];		// facet edge each point is on
+    int next;			// next segment in path, -1 for end
+    int used;
     struct
     {
       poly_dim_t x, y;
     } point[2];
   };
   int segcount = 0;
-  segment_t *segments = NULL, **next = &segments;
-  facet_t *f;
-  for (f = stl->facets; f; f = f->next)
+  segment_t *segments = mymalloc (sweep->count * sizeof (*segments) + 1);
+  int i;
+  for (i = 0; i < sweep->count; i++)
     {
+      facet_t *f = stl->facets + sweep->active[i]->facet;
+      stl_vertex_t *v[3] = { stl->vertices + f->vertex[0], stl->vertices + f->vertex[1], stl->vertices + f->vertex[2] };
       int a, b, c;
-      for (a = 0; a < 3 && f->vertex[a].z > z; a++);
+      for (a = 0; a < 3 && v[a]->z > z; a++);
       if (a == 3)
 	continue;		// all below
-      for (b = 0; b < 3 && f->vertex[b].z <= z; b++);
+      for (b = 0; b < 3 && v[b]->z <= z; b++);
       if (b == 3)		// all above
 	continue;
       for (c = 0; c == a || c == b; c++);
@@ -57,20 +131,20 @@ slice (stl_t * stl, poly_dim_t z, poly_dim_t tolerance)
       int dir = 0;
       if (a == (b + 1) % 3)
 	dir = 1;
-      segment_t *s = mymalloc (sizeof (*s));
-      *next = s;
-      s->prev = next;
-      next = &s->next;
-      s->point[dir].x = f->vertex[a].x + (f->vertex[b].x - f->vertex[a].x) * (z - f->vertex[a].z) / (f->vertex[b].z - f->vertex[a].z);
-      s->point[dir].y = f->vertex[a].y + (f->vertex[b].y - f->vertex[a].y) * (z - f->vertex[a].z) / (f->vertex[b].z - f->vertex[a].z);
+      segment_t *s = segments + segcount;
+      s->facet = f - stl->facets;
+      s->edge[dir] = (dir ? b : a);	// edge n is from vertex n to n+1
+      s->point[dir].x = v[a]->x + (v[b]->x - v[a]->x) * (z - v[a]->z) / (v[b]->z - v[a]->z);
+      s->point[dir].y = v[a]->y + (v[b]->y - v[a]->y) * (z - v[a]->z) / (v[b]->z - v[a]->z);
       // Line a->c or c->b is another facet... find point
-      if (f->vertex[c].z <= z)
+      if (v[c]->z <= z)
 	a = c;
       else
 	b = c;
-      s->point[1 - dir].x = f->vertex[a].x + (f->vertex[b].x - f->vertex[a].x) * (z - f->vertex[a].z) / (f->vertex[b].z - f->vertex[a].z);
-      s->point[1 - dir].y = f->vertex[a].y + (f->vertex[b].y - f->vertex[a].y) * (z - f->vertex[a].z) / (f->vertex[b].z - f->vertex[a].z);
-      segcount++;
+      s->edge[1 - dir] = (a == (b + 1) % 3 ? b : a);
+      s->point[1 - dir].x = v[a]->x + (v[b]->x - v[a]->x) * (z - v[a]->z) / (v[b]->z - v[a]->z);
+      s->point[1 - dir].y = v[a]->y + (v[b]->y - v[a]->y) * (z - v[a]->z) / (v[b]->z - v[a]->z);
+      sweep->segment[s->facet] = segcount++;
 #ifdef DEBUG
       fprintf (stderr, "Segment %s", dimout (s->point[0].x));
       fprintf (stderr, ",%s", dimout (s->point[0].y));
@@ -78,14 +152,17 @@ slice (stl_t * stl, poly_dim_t z, poly_dim_t tolerance)
       fprintf (stderr, ",%s\n", dimout (s->point[1].y));
 #endif
     }
-  if (!segments)
-    return NULL;		// nothing found at this Z
-  // Construct paths (and free segments)
+  if (!segcount)
+    {
+      free (segments);
+      return NULL;		// nothing found at this Z
+    }
+  // Construct paths
   polygon_t *outline = poly_new ();
   // find left most segment to start...
   segment_t *s, *b = NULL;
-  poly_dim_t x = 0, y = 0;
-  for (s = segments; s; s = s->next)
+  poly_dim_t x = 0;
+  for (s = segments; s < segments + segcount; s++)
     if (s->point[0].y != s->point[1].y)
       {
 	int e;
@@ -94,74 +171,173 @@ slice (stl_t * stl, poly_dim_t z, poly_dim_t tolerance)
 	    {
 	      b = s;
 	      x = s->point[e].x;
-	      y = s->point[e].y;
 	    }
       }
   // work out clockwise direction
   int dir = 0;
-  if (b->point[0].y > b->point[1].y)
+  if (b && b->point[0].y > b->point[1].y)
     dir = 1;
-  while (segments)
-    {
+  int follow (segment_t * s, int d)
+  {				// segment in facet on other side of the edge point d is on, or -1
+    int f = stl->adjacent[s->facet * 3 + s->edge[d]];
+    if (f < 0)
+      return -1;
+    int n = sweep->segment[f];
+    if (n < 0 || segments[n].used || stl->adjacent[f * 3 + segments[n].edge[1 - d]] != s->facet)
+      return -1;
+    return n;
+  }
+  // Chain segments by facet adjacency, each closed loop is a contour
+  int *open = mymalloc (segcount * sizeof (*open));	// heads of paths that did not close
+  int opens = 0, loose = 0;
+  for (i = 0; i < segcount; i++)
+    if (!segments[i].used)
+      {
+	int h = i, t = i, n;
+	segments[i].used = 1;
+	while ((n = follow (segments + t, 1 - dir)) >= 0)
+	  {
+	    segments[t].next = n;
+	    segments[n].used = 1;
+	    t = n;
+	  }
+	segments[t].next = -1;
+	if (stl->adjacent[segments[t].facet * 3 + segments[t].edge[1 - dir]] == segments[h].facet
+	    && stl->adjacent[segments[h].facet * 3 + segments[h].edge[dir]] == segments[t].facet && t != h)
+	  {			// closed
+	    poly_start (outline);
+	    for (n = h; n >= 0; n = segments[n].next)
+	      poly_add (outline, segments[n].point[dir].x, segments[n].point[dir].y, 0);
+	    continue;
+	  }
+	while ((n = follow (segments + h, dir)) >= 0)
+	  {			// extend back
+	    segments[n].next = h;
+	    segments[n].used = 1;
+	    h = n;
+	  }
+	open[opens++] = h;
+      }
+  // Paths that did not close (non manifold mesh) are joined by closest end within tolerance
+  for (i = 0; i < opens; i++)
+    if (open[i] >= 0)
+      {
 #ifdef DEBUG
-      fprintf (stderr, "Starting %s", dimout (x));
-      fprintf (stderr, ",%s\n", dimout (y));
+	fprintf (stderr, "Starting %s", dimout (segments[open[i]].point[dir].x));
+	fprintf (stderr, ",%s\n", dimout (segments[open[i]].point[dir].y));
 #endif
-      poly_start (outline);
-      b = segments;		// pick a point
-      while (1)
-	{
-	  // unlink
-	  if (b->next)
-	    b->next->prev = b->prev;
-	  *b->prev = b->next;
-	  poly_add (outline, b->point[dir].x, b->point[dir].y, 0);
-	  poly_dim_t x = b->point[1 - dir].x;
-	  poly_dim_t y = b->point[1 - dir].y;
-	  free (b);
-	  // find closest connected point
-	  poly_dim_t bestd = 0;
-	  b = NULL;
-	  for (s = segments; s; s = s->next)
-	    {
-	      poly_dim_t d = (s->point[dir].x - x) * (s->point[dir].x - x) + (s->point[dir].y - y) * (s->point[dir].y - y);
-	      if (!b || d < bestd)
+	poly_start (outline);
+	int n = open[i];
+	open[i] = -1;
+	while (1)
+	  {
+	    poly_dim_t x = 0, y = 0;
+	    for (; n >= 0; n = segments[n].next)
+	      {
+		poly_add (outline, segments[n].point[dir].x, segments[n].point[dir].y, 0);
+		x = segments[n].point[1 - dir].x;
+		y = segments[n].point[1 - dir].y;
+		loose++;
+	      }
+	    // find closest connected point
+	    poly_dim_t bestd = 0;
+	    int j, best = -1;
+	    for (j = i + 1; j < opens; j++)
+	      if (open[j] >= 0)
 		{
-		  b = s;
-		  bestd = d;
+		  segment_t *s = segments + open[j];
+		  poly_dim_t d = (s->point[dir].x - x) * (s->point[dir].x - x) + (s->point[dir].y - y) * (s->point[dir].y - y);
+		  if (best < 0 || d < bestd)
+		    {
+		      best = j;
+		      bestd = d;
+		    }
 		}
-	    }
-	  if (!b || bestd > tolerance2)
-	    break;
+	    if (best < 0 || bestd > tolerance2)
+	      break;
 #ifdef DEBUG
-	  fprintf (stderr, "Best %s\n", dimout (bestd));
+	    fprintf (stderr, "Best %s\n", dimout (bestd));
 #endif
-	}
-    }
-
-  int seglost = 0;
-  if (segments)
-    {
-      while (segments)
-	{
-	  seglost++;
-#if 0
-	  fprintf (stderr, "Segment %s", dimout (segments->point[0].x));
-	  fprintf (stderr, ",%s", dimout (segments->point[0].y));
-	  fprintf (stderr, " %s", dimout (segments->point[1].x));
-	  fprintf (stderr, ",%s\n", dimout (segments->point[1].y));
-#endif
-	  segment_t *s = segments->next;
-	  free (segments);
-	  segments = s;
-	}
-    }
+	    n = open[best];
+	    open[best] = -1;
+	  }
+      }
+  for (i = 0; i < segcount; i++)
+    sweep->segment[segments[i].facet] = -1;
+  free (open);
+  free (segments);
   if (debug)
-    fprintf (stderr, "Slicing at %s made %d segments\n", dimout (z), segcount);
+    fprintf (stderr, "Slicing at %s made %d segments%s%.0d%s\n", dimout (z), segcount, loose ? " (" : "", loose,
+	     loose ? " not joined by shared edges)" : "");
   slice_t *slice = mymalloc (sizeof (*slice));
   slice->z = z;
+  slice->loose = loose;
   poly_tidy (outline, tolerance / 10);
   slice->outline = poly_clip (POLY_UNION, 1, outline);
   poly_free (outline);
   return slice;
 }
+
+slice_t *
+slice (stl_t * stl, poly_dim_t z, poly_dim_t tolerance)
+{				// Make one slice
+  if (!stl->zindex)
+    stl_index (stl);
+  sweep_t sweep;
+  sweep_start (&sweep, stl);
+  sweep_to (&sweep, z);
+  slice_t *s = slice_sweep (&sweep, z, tolerance);
+  sweep_end (&sweep);
+  return s;
+}
+
+typedef struct layers_s layers_t;
+struct layers_s
+{				// Layers to slice, in blocks
+  stl_t *stl;
+  poly_dim_t start, step, tolerance;
+  int count;			// layers
+  int blocks;			// blocks of consecutive layers
+  slice_t **slice;		// result for each layer
+};
+
+static void
+slice_block (void *arg, int n)
+{				// Slice a block of layers, with its own sweep up through the Z index
+  layers_t *l = arg;
+  int from = (long long) l->count * n / l->blocks, to = (long long) l->count * (n + 1) / l->blocks;
+  sweep_t sweep;
+  sweep_start (&sweep, l->stl);
+  for (; from < to; from++)
+    {
+      poly_dim_t z = l->start + l->step * from;
+      sweep_to (&sweep, z);
+      l->slice[from] = slice_sweep (&sweep, z, l->tolerance);
+    }
+  sweep_end (&sweep);
+}
+
+void
+slice_all (stl_t * stl, poly_dim_t start, poly_dim_t end, poly_dim_t step, poly_dim_t tolerance)
+{				// Make all slices, layers are sliced in parallel then linked in Z order
+  if (!stl->zindex)
+    stl_index (stl);
+  if (end < start || step <= 0)
+    return;
+  layers_t l = {.stl = stl,.start = start,.step = step,.tolerance = tolerance };
+  l.count = (end - start) / step + 1;
+  l.blocks = workers () * 4;	// each block sweeps from the bottom, so not too many
+  if (l.blocks > l.count)
+    l.blocks = l.count;
+  l.slice = mymalloc (l.count * sizeof (*l.slice));
+  parallel (l.blocks, slice_block, &l);
+  slice_t **last = &stl->slices;
+  int n;
+  for (n = 0; n < l.count; n++)
+    if (l.slice[n])
+      {
+	*last = l.slice[n];
+	last = &l.slice[n]->next;
+      }
+  free (l.slice);
+}
@@ -17,4 +17,5 @@
 
 #include "e3d.h"
 
-slice_t *slice (stl_t *, poly_dim_t z, poly_dim_t tolerance);
+slice_t *slice (stl_t *, poly_dim_t z, poly_dim_t tolerance);	// Make one slice
+void slice_all (stl_t *, poly_dim_t start, poly_dim_t end, poly_dim_t step, poly_dim_t tolerance);	// Make stl->slices, needs stl_index
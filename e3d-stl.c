@@ -19,139 +19,590 @@
 #include <string.h>
 #include <err.h>
 #include <ctype.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "e3d-stl.h"
 
-stl_t *
-stl_read (const char *filename)
-{				// Read an STL file
-  FILE *f = fopen (filename, "r");
-  if (!f)
+static void
+stl_debug (stl_t * stl)
+{
+  if (!debug)
+    return;
+  fprintf (stderr, "STL read %d facets (%d vertices) from %s [%s]\n", stl->count, stl->vcount, stl->filename, stl->name);
+  fprintf (stderr, "Min X %s\n", dimout (stl->min.x));
+  fprintf (stderr, "Max X %s\n", dimout (stl->max.x));
+  fprintf (stderr, "Min Y %s\n", dimout (stl->min.y));
+  fprintf (stderr, "Max Y %s\n", dimout (stl->max.y));
+  fprintf (stderr, "Min Z %s\n", dimout (stl->min.z));
+  fprintf (stderr, "Max Z %s\n", dimout (stl->max.z));
+}
+
+static inline float
+stl_float (const unsigned char *p)
+{				// Little endian IEEE float from binary STL
+  union
+  {
+    uint32_t i;
+    float f;
+  } u;
+  u.i = p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t) p[3] << 24);
+  return u.f;
+}
+
+typedef struct mesh_s mesh_t;
+struct mesh_s
+{				// Building an indexed mesh, vertices de-duplicated by exact co-ordinates
+  stl_t *stl;
+  int vmax;			// allocated vertices
+  int fmax;			// allocated facets
+  int size;			// hash size, power of 2
+  int *hash;			// vertex index+1, 0 for unused
+};
+
+static inline unsigned int
+mesh_hash (poly_dim_t x, poly_dim_t y, poly_dim_t z)
+{
+  unsigned long long h =
+    (unsigned long long) (long long) x *0x9E3779B97F4A7C15ULL ^ (unsigned long long) (long long) y *0xC2B2AE3D27D4EB4FULL ^
+    (unsigned long long) (long long) z *0x165667B19E3779F9ULL;
+  return h ^ (h >> 32);
+}
+
+static void
+mesh_rehash (mesh_t * m, int size)
+{
+  stl_t *stl = m->stl;
+  free (m->hash);
+  m->size = size;
+  m->hash = mymalloc (size * sizeof (*m->hash));
+  int v;
+  for (v = 0; v < stl->vcount; v++)
+    {
+      unsigned int h = mesh_hash (stl->vertices[v].x, stl->vertices[v].y, stl->vertices[v].z) & (size - 1);
+      while (m->hash[h])
+	h = (h + 1) & (size - 1);
+      m->hash[h] = v + 1;
+    }
+}
+
+static int
+mesh_vertex (mesh_t * m, poly_dim_t x, poly_dim_t y, poly_dim_t z)
+{				// Return index of vertex, adding if new
+  stl_t *stl = m->stl;
+  if (stl->vcount * 2 >= m->size)
+    mesh_rehash (m, m->size ? m->size * 2 : 1024);
+  unsigned int h = mesh_hash (x, y, z) & (m->size - 1);
+  while (m->hash[h])
+    {
+      stl_vertex_t *v = stl->vertices + m->hash[h] - 1;
+      if (v->x == x && v->y == y && v->z == z)
+	return m->hash[h] - 1;
+      h = (h + 1) & (m->size - 1);
+    }
+  if (stl->vcount == m->vmax)
+    {
+      m->vmax = (m->vmax ? m->vmax * 2 : 1024);
+      stl->vertices = realloc (stl->vertices, m->vmax * sizeof (*stl->vertices));
+      if (!stl->vertices)
+	errx (1, "Cannot allocate %d vertices", m->vmax);
+    }
+  if (!stl->vcount || x < stl->min.x)
+    stl->min.x = x;
+  if (!stl->vcount || x > stl->max.x)
+    stl->max.x = x;
+  if (!stl->vcount || y < stl->min.y)
+    stl->min.y = y;
+  if (!stl->vcount || y > stl->max.y)
+    stl->max.y = y;
+  if (!stl->vcount || z < stl->min.z)
+    stl->min.z = z;
+  if (!stl->vcount || z > stl->max.z)
+    stl->max.z = z;
+  stl_vertex_t *v = stl->vertices + stl->vcount;
+  v->x = x;
+  v->y = y;
+  v->z = z;
+  m->hash[h] = ++stl->vcount;
+  return stl->vcount - 1;
+}
+
+static facet_t *
+mesh_facet (mesh_t * m)
+{				// Add a facet
+  stl_t *stl = m->stl;
+  if (stl->count == m->fmax)
+    {
+      m->fmax = (m->fmax ? m->fmax * 2 : 1024);
+      stl->facets = realloc (stl->facets, m->fmax * sizeof (*stl->facets));
+      if (!stl->facets)
+	errx (1, "Cannot allocate %d facets", m->fmax);
+    }
+  return stl->facets + stl->count++;
+}
+
+static void
+mesh_done (mesh_t * m)
+{				// Finished loading, release spare space
+  stl_t *stl = m->stl;
+  free (m->hash);
+  if (stl->vcount && stl->vcount < m->vmax)
+    stl->vertices = realloc (stl->vertices, stl->vcount * sizeof (*stl->vertices));
+  if (stl->count && stl->count < m->fmax)
+    stl->facets = realloc (stl->facets, stl->count * sizeof (*stl->facets));
+}
+
+static void
+stl_read_binary (stl_t * stl, const unsigned char *data, int n)
+{				// Binary STL, 80 byte header, 32 bit count, 50 byte records
+  {				// header is free text, often starts solid
+    char name[81];
+    memcpy (name, data, 80);
+    name[80] = 0;
+    char *p = name + strlen (name);
+    while (p > name && p[-1] <= ' ')
+      p--;
+    *p = 0;
+    p = name;
+    if (!strncasecmp (p, "solid", 5))
+      p += 5;
+    while (isspace (*p))
+      p++;
+    stl->name = strdup (p);
+  }
+  if (!n)
+    return;			// no facets
+  mesh_t m = {.stl = stl,.fmax = n,.vmax = n / 2 + 16 };	// typically half as many vertices as facets
+  stl->facets = mymalloc ((size_t) m.fmax * sizeof (*stl->facets));
+  stl->vertices = mymalloc ((size_t) m.vmax * sizeof (*stl->vertices));
+  const unsigned char *r = data + 84 + 12;	// skip normal
+  int i;
+  for (i = 0; i < n; i++, r += 50)
+    {
+      facet_t *element = mesh_facet (&m);
+      int vertex;
+      for (vertex = 0; vertex < 3; vertex++)
+	{
+	  const unsigned char *v = r + vertex * 12;
+#ifdef	FIXED
+	  element->vertex[vertex] =
+	    mesh_vertex (&m, llroundl ((long double) stl_float (v) * fixed), llroundl ((long double) stl_float (v + 4) * fixed),
+			 llroundl ((long double) stl_float (v + 8) * fixed));
+#else
+	  element->vertex[vertex] = mesh_vertex (&m, stl_float (v), stl_float (v + 4), stl_float (v + 8));
+#endif
+	}
+    }
+  mesh_done (&m);
+}
+
+static inline int
+stl_word (const char *p, const char *e, const char *w, int l)
+{				// Check line starts with keyword
+  return e - p >= l && !strncasecmp (p, w, l);
+}
+
+static const char *
+stl_number (const char *p, const char *e, poly_dim_t * vp)
+{				// Parse a number, returns end or NULL if not valid
+  while (p < e && isspace (*p))
+    p++;
+#ifdef	FIXED
+  // Decimal straight to fixed point, truncating extra places, no long double conversion
+  int neg = 0, digits = 0, exp = FIXED;
+  unsigned long long m = 0;
+  if (p < e && (*p == '-' || *p == '+'))
+    neg = (*p++ == '-');
+  for (; p < e && *p >= '0' && *p <= '9'; p++, digits++)
+    if (m < 100000000000000000ULL)
+      m = m * 10 + *p - '0';
+    else
+      exp++;			// excess precision
+  if (p < e && *p == '.')
+    for (p++; p < e && *p >= '0' && *p <= '9'; p++, digits++)
+      if (m < 100000000000000000ULL)
+	{
+	  m = m * 10 + *p - '0';
+	  exp--;
+	}
+  if (!digits)
     return NULL;
-  stl_t *stl = mymalloc (sizeof (*stl));
-  stl->filename = strdup (filename);
-  facet_t *element = NULL, **next = &stl->facets;
-  int vertex = 0, lineno = 0;
-  char line[100];
-  while (fgets (line, sizeof (line), f))
+  if (p < e && (*p == 'e' || *p == 'E'))
+    {
+      int eneg = 0, ex = 0;
+      p++;
+      if (p < e && (*p == '-' || *p == '+'))
+	eneg = (*p++ == '-');
+      if (p >= e || *p < '0' || *p > '9')
+	return NULL;
+      for (; p < e && *p >= '0' && *p <= '9'; p++)
+	if (ex < 10000)
+	  ex = ex * 10 + *p - '0';
+      exp += (eneg ? -ex : ex);
+    }
+  for (; exp < 0 && m; exp++)
+    m /= 10;
+  for (; exp > 0 && m; exp--)
+    {
+      if (m > LLONG_MAX / 10)
+	return NULL;
+      m *= 10;
+    }
+  *vp = (neg ? -(poly_dim_t) m : (poly_dim_t) m);
+  return p;
+#else
+  char temp[100], *end;
+  int l = e - p;
+  if (l >= sizeof (temp))
+    l = sizeof (temp) - 1;
+  memcpy (temp, p, l);
+  temp[l] = 0;
+  *vp = strtold (temp, &end);
+  if (end == temp)
+    return NULL;
+  return p + (end - temp);
+#endif
+}
+
+typedef struct chunk_s chunk_t;
+struct chunk_s
+{				// Part of an ASCII STL, starting on a facet line, parsed by one thread
+  const char *start, *end;	// text
+  const char *eof;		// end of whole file
+  int lines;			// lines parsed
+  int count, max;		// facets
+  poly_dim_t *v;		// 9 co-ordinates per facet
+  const char *name, *namee;	// solid name
+  int solid;			// line of solid (0 if none)
+  int endsolid;			// seen endsolid, so stopped
+  const char *error;		// error message
+  int errorline;		// line of error
+  const char *line, *linee;	// line with error
+};
+
+static void
+stl_chunk (void *arg, int n)
+{				// Parse a chunk of ASCII STL
+  chunk_t *c = (chunk_t *) arg + n;
+  const char *p = c->start, *e, *l;
+  int element = 0, vertex = 0;
+  int facet = 0;		// line the current facet started on, 0 if none
+  const char *facetp = NULL, *facete = NULL;
+  poly_dim_t *v = NULL;
+  for (; p < c->end; p = l)
     {
-      lineno++;
+      c->lines++;
+      l = memchr (p, '\n', c->end - p);
+      l = (l ? l + 1 : c->end);
+      e = l;
+      c->line = p;
+      c->linee = e;
       void panic (const char *e)
       {
-	errx (1, "Line %d: %s\n%s\n", lineno, e, line);
+	c->error = e;
+	c->errorline = c->lines;
       }
-      char *p = line + strlen (line);
-      while (p > line && p[-1] < ' ')
-	p--;
-      *p = 0;
-      for (p = line; isspace (*p); p++);
-      if (!strncasecmp (p, "solid", 5))
+      while (e > p && e[-1] < ' ')
+	e--;
+      while (p < e && isspace (*p))
+	p++;
+      if (stl_word (p, e, "solid", 5))
 	{
-	  if (stl->name)
-	    panic ("More than one solid in STL");
-	  p += 5;
-	  while (isspace (*p))
-	    p++;
-	  stl->name = strdup (p);
+	  if (c->solid)
+	    {
+	      panic ("More than one solid in STL");
+	      return;
+	    }
+	  c->solid = c->lines;
+	  for (p += 5; p < e && isspace (*p); p++);
+	  c->name = p;
+	  c->namee = e;
 	  continue;
 	}
-      if (!strncasecmp (p, "facet", 5))
+      if (stl_word (p, e, "facet", 5))
 	{
 	  if (element)
-	    panic ("facet unexpected");
+	    {
+	      panic ("facet unexpected");
+	      return;
+	    }
+	  facet = c->lines;
+	  facetp = c->line;
+	  facete = e;
 	  continue;
 	}
-      if (!strncasecmp (p, "outer", 5))
+      if (stl_word (p, e, "outer", 5))
 	{
 	  if (element)
-	    panic ("outer unexpected");
+	    {
+	      panic ("outer unexpected");
+	      return;
+	    }
 	  vertex = 0;
-	  element = mymalloc (sizeof (*element));
-	  *next = element;
-	  next = &element->next;
+	  element = 1;
+	  if (!facet)
+	    {			// no facet line
+	      facet = c->lines;
+	      facetp = c->line;
+	      facete = e;
+	    }
+	  if (c->count == c->max)
+	    {
+	      c->max = (c->max ? c->max * 2 : 1024);
+	      c->v = realloc (c->v, c->max * 9 * sizeof (*c->v));
+	      if (!c->v)
+		errx (1, "Cannot allocate %d facets", c->max);
+	    }
+	  v = c->v + c->count * 9;
 	  continue;
 	}
-      if (!strncasecmp (p, "endloop", 7))
+      if (stl_word (p, e, "endloop", 7))
 	{
 	  if (vertex != 3)
-	    panic ("Unexpected endloop (not 3 vertices)");
+	    {
+	      panic ("Unexpected endloop (not 3 vertices)");
+	      return;
+	    }
 	  vertex = 0;
 	  continue;
 	}
-      if (!strncasecmp (p, "endfacet", 8))
+      if (stl_word (p, e, "endfacet", 8))
 	{
 	  if (vertex || !element)
-	    panic ("Unexpected endfacet");
-	  element = NULL;
-	  stl->count++;
+	    {
+	      panic ("Unexpected endfacet");
+	      return;
+	    }
+	  element = 0;
+	  facet = 0;
+	  c->count++;
 	  continue;
 	}
-      if (!strncasecmp (p, "vertex", 6))
+      if (stl_word (p, e, "vertex", 6))
 	{
 	  if (vertex >= 3)
-	    panic ("Too many vertices");
-	  long double x, y, z;
-	  if (sscanf (p, "vertex %Lf %Lf %Lf", &x, &y, &z) != 3)
-	    panic ("Cannot parse vertex");
-#ifdef	FIXED
-	  element->vertex[vertex].x = x * fixed;
-	  element->vertex[vertex].y = y * fixed;
-	  element->vertex[vertex].z = z * fixed;
-#else
-	  element->vertex[vertex].x = x;
-	  element->vertex[vertex].y = y;
-	  element->vertex[vertex].z = z;
-#endif
-	  if ((!stl->count && !vertex) || element->vertex[vertex].x < stl->min.x)
-	    stl->min.x = element->vertex[vertex].x;
-	  if ((!stl->count && !vertex) || element->vertex[vertex].x > stl->max.x)
-	    stl->max.x = element->vertex[vertex].x;
-	  if ((!stl->count && !vertex) || element->vertex[vertex].y < stl->min.y)
-	    stl->min.y = element->vertex[vertex].y;
-	  if ((!stl->count && !vertex) || element->vertex[vertex].y > stl->max.y)
-	    stl->max.y = element->vertex[vertex].y;
-	  if ((!stl->count && !vertex) || element->vertex[vertex].z < stl->min.z)
-	    stl->min.z = element->vertex[vertex].z;
-	  if ((!stl->count && !vertex) || element->vertex[vertex].z > stl->max.z)
-	    stl->max.z = element->vertex[vertex].z;
+	    {
+	      panic ("Too many vertices");
+	      return;
+	    }
+	  if (!element || !(p = stl_number (p + 6, e, v + vertex * 3)) || !(p = stl_number (p, e, v + vertex * 3 + 1))
+	      || !(p = stl_number (p, e, v + vertex * 3 + 2)))
+	    {
+	      panic ("Cannot parse vertex");
+	      return;
+	    }
 	  vertex++;
 	  continue;
 	}
-      if (!strncasecmp (p, "endsolid", 8))
+      if (stl_word (p, e, "endsolid", 8))
 	{
 	  if (element)
-	    panic ("Unexpected endsolid");
-	  break;
+	    {
+	      panic ("Unexpected endsolid");
+	      return;
+	    }
+	  c->endsolid = 1;
+	  return;
 	}
       panic ("unexpected line");
+      return;
     }
-  fclose (f);
-  if (debug)
+  if (facet && c->end == c->eof)
+    {				// cut off by end of file
+      c->line = facetp;
+      c->linee = facete;
+      c->error = "Incomplete facet";
+      c->errorline = facet;
+    }
+  else if (element)
+    {				// chunks start on facet lines, so next line is a facet
+      c->lines++;
+      c->line = c->end;
+      c->linee = memchr (c->end, '\n', c->eof - c->end) ? : c->eof;
+      c->error = "facet unexpected";
+      c->errorline = c->lines;
+    }
+}
+
+static void
+stl_read_ascii (stl_t * stl, const char *data, size_t len)
+{				// ASCII STL, parsed in chunks in parallel
+  int chunks = workers () * 4;
+  if (chunks > len / 262144)
+    chunks = len / 262144;	// not worth splitting small files
+  if (chunks < 1)
+    chunks = 1;
+  chunk_t *chunk = mymalloc (chunks * sizeof (*chunk));
+  const char *end = data + len;
+  int n;
+  chunk[0].start = data;
+  for (n = 1; n < chunks; n++)
+    {				// find start of a facet line
+      const char *p = data + len * n / chunks;
+      if (p < chunk[n - 1].start)
+	p = chunk[n - 1].start;
+      while (p < end)
+	{
+	  p = memchr (p, '\n', end - p);
+	  if (!p++)
+	    p = end;
+	  const char *q = p;
+	  while (q < end && (*q == ' ' || *q == '\t'))
+	    q++;
+	  if (stl_word (q, end, "facet", 5))
+	    break;
+	}
+      chunk[n - 1].end = chunk[n].start = p;
+    }
+  chunk[chunks - 1].end = end;
+  for (n = 0; n < chunks; n++)
+    chunk[n].eof = end;
+  parallel (chunks, stl_chunk, chunk);
+  // Merge in order, checking errors as we go
+  mesh_t m = {.stl = stl };
+  int lineno = 0;
+  for (n = 0; n < chunks; n++)
     {
-      fprintf (stderr, "STL read %d facets from %s [%s]\n", stl->count, stl->filename, stl->name);
-      fprintf (stderr, "Min X %s\n", dimout (stl->min.x));
-      fprintf (stderr, "Max X %s\n", dimout (stl->max.x));
-      fprintf (stderr, "Min Y %s\n", dimout (stl->min.y));
-      fprintf (stderr, "Max Y %s\n", dimout (stl->max.y));
-      fprintf (stderr, "Min Z %s\n", dimout (stl->min.z));
-      fprintf (stderr, "Max Z %s\n", dimout (stl->max.z));
+      chunk_t *c = chunk + n;
+      void panic (int line, const char *e, const char *p, const char *l)
+      {
+	while (l > p && l[-1] < ' ')
+	  l--;
+	errx (1, "Line %d: %s\n%.*s\n", lineno + line, e, (int) (l - p), p);
+      }
+      if (c->solid && stl->name)
+	{
+	  const char *p = c->start;
+	  int line = 1;
+	  while (line < c->solid)
+	    {
+	      p = memchr (p, '\n', c->end - p) + 1;
+	      line++;
+	    }
+	  panic (line, "More than one solid in STL", p, memchr (p, '\n', c->end - p) ? : c->end);
+	}
+      if (c->solid)
+	stl->name = strndup (c->name, c->namee - c->name);
+      if (c->error)
+	panic (c->errorline, c->error, c->line, c->linee);
+      int f, v;
+      for (f = 0; f < c->count; f++)
+	{
+	  facet_t *element = mesh_facet (&m);
+	  poly_dim_t *p = c->v + f * 9;
+	  for (v = 0; v < 3; v++)
+	    element->vertex[v] = mesh_vertex (&m, p[v * 3], p[v * 3 + 1], p[v * 3 + 2]);
+	}
+      lineno += c->lines;
+      if (c->endsolid)
+	break;
     }
+  for (n = 0; n < chunks; n++)
+    free (chunk[n].v);
+  free (chunk);
+  mesh_done (&m);
+}
+
+static inline unsigned int
+edge_hash (int a, int b)
+{
+  unsigned int h = a * 0x9E3779B1U ^ b * 0x85EBCA77U;
+  return h ^ (h >> 15);
+}
+
+static void
+stl_adjacent (stl_t * stl)
+{				// Find the facet on the other side of each edge, using a hash of directed edges
+  // A shared edge runs opposite ways in the two facets, anything else is non manifold and has no neighbour
+  int size = 1024;
+  while (size < stl->count * 4)
+    size *= 2;
+  int *hash = mymalloc (size * sizeof (*hash));	// facet*3+edge+1, 0 for unused
+  stl->adjacent = mymalloc (stl->count * 3 * sizeof (*stl->adjacent) + 1);
+  int f, e;
+#define	ev(f,e,n) stl->facets[f].vertex[((e)+(n))%3]
+  for (f = 0; f < stl->count; f++)
+    for (e = 0; e < 3; e++)
+      if (ev (f, e, 0) != ev (f, e, 1))
+	{
+	  unsigned int h = edge_hash (ev (f, e, 0), ev (f, e, 1)) & (size - 1);
+	  while (hash[h])
+	    h = (h + 1) & (size - 1);
+	  hash[h] = f * 3 + e + 1;
+	}
+  for (f = 0; f < stl->count; f++)
+    for (e = 0; e < 3; e++)
+      {
+	int a = ev (f, e, 0), b = ev (f, e, 1), same = 0, other = 0, n = -1;
+	unsigned int h;
+	if (a != b)
+	  {
+	    for (h = edge_hash (a, b) & (size - 1); hash[h]; h = (h + 1) & (size - 1))
+	      if (ev ((hash[h] - 1) / 3, (hash[h] - 1) % 3, 0) == a && ev ((hash[h] - 1) / 3, (hash[h] - 1) % 3, 1) == b)
+		same++;
+	    for (h = edge_hash (b, a) & (size - 1); hash[h]; h = (h + 1) & (size - 1))
+	      if (ev ((hash[h] - 1) / 3, (hash[h] - 1) % 3, 0) == b && ev ((hash[h] - 1) / 3, (hash[h] - 1) % 3, 1) == a)
+		{
+		  other++;
+		  n = (hash[h] - 1) / 3;
+		}
+	  }
+	stl->adjacent[f * 3 + e] = (same == 1 && other == 1 ? n : -1);
+      }
+#undef ev
+  free (hash);
+}
+
+stl_t *
+stl_read (const char *filename)
+{				// Read an STL file
+  int fd = open (filename, O_RDONLY);
+  if (fd < 0)
+    return NULL;
+  struct stat st;
+  if (fstat (fd, &st))
+    {
+      close (fd);
+      return NULL;
+    }
+  stl_t *stl = mymalloc (sizeof (*stl));
+  stl->filename = strdup (filename);
+  if (!st.st_size)
+    errx (1, "Empty file %s", filename);
+  const unsigned char *data = mmap (NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (data == MAP_FAILED)
+    err (1, "Cannot map %s", filename);
+  close (fd);
+  madvise ((void *) data, st.st_size, MADV_SEQUENTIAL);
+  uint32_t n = 0;
+  if (st.st_size >= 84)
+    n = data[80] | (data[81] << 8) | (data[82] << 16) | ((uint32_t) data[83] << 24);
+  if (st.st_size >= 84 && 84 + 50 * (off_t) n <= st.st_size
+      && (84 + 50 * (off_t) n == st.st_size || strncasecmp ((const char *) data, "solid", 5)
+	  || (!memmem (data, st.st_size, "facet", 5) && !memmem (data, st.st_size, "FACET", 5))))
+    stl_read_binary (stl, data, n);	// Binary STL, exact size, or room for the facets and not ASCII, ignoring any trailing bytes
+  else
+    stl_read_ascii (stl, (const char *) data, st.st_size);
+  munmap ((void *) data, st.st_size);
+  stl_adjacent (stl);
+  stl_debug (stl);
   return stl;
 }
 
 void
 stl_origin (stl_t * stl)
 {				// Set file at zero x/y/z
-  facet_t *e;
-  for (e = stl->facets; e; e = e->next)
-    {
-      int v;
-      for (v = 0; v < 3; v++)
-	{
-	  e->vertex[v].x -= stl->min.x;
-	  e->vertex[v].y -= stl->min.y;
-	  e->vertex[v].z -= stl->min.z;
-	}
+  stl_vertex_t *v;
+  for (v = stl->vertices; v < stl->vertices + stl->vcount; v++)
+    {				// each shared vertex only moved once
+      v->x -= stl->min.x;
+      v->y -= stl->min.y;
+      v->z -= stl->min.z;
     }
   stl->max.x -= stl->min.x;
   stl->max.y -= stl->min.y;
@@ -167,3 +618,30 @@ stl_origin (stl_t * stl)
       fprintf (stderr, "Max Z %s\n", dimout (stl->max.z));
     }
 }
+
+void
+stl_index (stl_t * stl)
+{				// Make Z index, facets sorted by lowest Z, so slicing only has to look at facets crossing each layer
+  free (stl->zindex);
+  stl->zindex = mymalloc (stl->count * sizeof (*stl->zindex) + 1);
+  int f;
+  for (f = 0; f < stl->count; f++)
+    {
+      stl_zindex_t *i = stl->zindex + f;
+      facet_t *e = stl->facets + f;
+      poly_dim_t a = stl->vertices[e->vertex[0]].z, b = stl->vertices[e->vertex[1]].z, c = stl->vertices[e->vertex[2]].z;
+      i->min = MIN (a, MIN (b, c));
+      i->max = MAX (a, MAX (b, c));
+      i->facet = f;
+    }
+  int order (const void *ap, const void *bp)
+  {
+    const stl_zindex_t *a = ap, *b = bp;
+    if (a->min < b->min)
+      return -1;
+    if (a->min > b->min)
+      return 1;
+    return a->facet - b->facet;
+  }
+  qsort (stl->zindex, stl->count, sizeof (*stl->zindex), order);
+}
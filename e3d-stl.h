@@ -19,3 +19,4 @@
 
 stl_t *stl_read (const char *filename);
 void stl_origin (stl_t * stl);
+void stl_index (stl_t * stl);	// Make Z index of facets
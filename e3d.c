@@ -31,6 +31,8 @@ int debug = 0;
 
 int places = 4;
 
+int threads = 0;
+
 int
 main (int argc, const char *argv[])
 {
@@ -68,6 +70,7 @@ main (int argc, const char *argv[])
   int temp0 = 0;
   int temp = 0;
   int quiet = 0;
+  int travel = 0;
 
   char c;
   poptContext optCon;		// context for parsing command-line options
@@ -101,7 +104,10 @@ main (int argc, const char *argv[])
     {"bed", 0, POPT_ARG_INT, &tempbed, 0, "Set temp of bed (M140)", "C"},
     {"hop", 0, POPT_ARGFLAG_SHOW_DEFAULT | POPT_ARG_DOUBLE, &hop, 0, "Hop up when moving and not extruding", "Units"},
     {"back", 0, POPT_ARGFLAG_SHOW_DEFAULT | POPT_ARG_DOUBLE, &back, 0, "Pull back extrude when not extruding", "Units"},
+    {"travel", 0, POPT_ARGFLAG_SHOW_DEFAULT | POPT_ARG_INT, &travel, 0, "Time per layer to improve travel order (output then depends on speed)", "ms"},
     {"fast", 0, POPT_ARG_NONE, &fast, 0, "Fast print of infill by reduced precision", 0},
+    {"capsule-inset", 0, POPT_ARG_NONE, &poly_inset_capsule, 0, "Inset using union of thick lines (old, slower, method)", 0},
+    {"threads", 't', POPT_ARG_INT, &threads, 0, "Worker threads (default one per CPU)", "N"},
     {"mirror", 'm', POPT_ARG_NONE, &mirror, 0, "Mirror image GCODE output", 0},
     {"debug", 'v', POPT_ARG_NONE, &debug, 0, "Debug", 0},
     {"quiet", 'q', POPT_ARG_NONE, &quiet, 0, "Quiet (don't print timings, etc)", 0},
@@ -176,6 +182,7 @@ main (int argc, const char *argv[])
     errx (1, "Cannot read %s", stlfile);
 
   stl_origin (stl);		// Origin file at X/Y/Z zero
+  stl_index (stl);		// Index facets by Z for slicing
 
   poly_dim_t sz = d2dim (startz);
   poly_dim_t l = d2dim (layer);
@@ -192,32 +199,22 @@ main (int argc, const char *argv[])
     ez = stl->max.z;
   poly_dim_t width = l * widthratio;
 
-  {				// Slice the STL
-    if (tol < 0)
-      tol = layer;
-    slice_t **last = &stl->slices;
-    poly_dim_t z;
-    for (z = sz; z <= ez; z += l)
-      {
-	slice_t *this = slice (stl, z, tol);
-	if (this)
-	  {
-	    *last = this;
-	    last = &this->next;
-	  }
-      }
-  }
+  if (tol < 0)
+    tol = layer;
+  slice_all (stl, sz, ez, l, tol);	// Slice the STL
+  if (!quiet)
+    {
+      int loose = 0;
+      slice_t *s;
+      for (s = stl->slices; s; s = s->next)
+	loose += s->loose;
+      if (loose)
+	printf ("Non manifold mesh, %d segments joined by distance\n", loose);
+    }
 
-  {				// Fill
-    int count = 1;
-    slice_t *s = stl->slices;
-    fill_perimeter (s, width, skins0, 0);
-    s = s->next;
-    for (; s; s = s->next)
-      fill_perimeter (s, width, skins + (((count++) & 1) ? altskins : 0), fast);
-    fill_area (stl, width, layers);
-    fill_extrude (stl, width, density, infillflow);
-  }
+  fill_perimeters (stl, width, skins0, skins, altskins, fast);	// Fill
+  fill_area (stl, width, layers);
+  fill_extrude (stl, width, density, infillflow);
 
   if (anchorloops)
     fill_anchor (stl, anchorloops, width, width * anchorgap, width * anchorstep);
@@ -241,7 +238,7 @@ main (int argc, const char *argv[])
       unsigned int t =
 	gcode_out (gcodefile, stl, layer * layer * widthratio / filament / filament * packing, l, speed0s, speeds, zspeeds, back, hops, mirror, anchorflow,
 		   infillflow,
-		   eplaces, tempbed, temp0, temp, quiet);
+		   eplaces, tempbed, temp0, temp, quiet, travel);
       if (!quiet)
 	{
 	  if (tempbed)
@@ -258,6 +255,13 @@ main (int argc, const char *argv[])
   if (svgfile)
     svg_out (svgfile, stl, width);
 
+  if (debug)
+    {
+      poly_stats_t s;
+      poly_stats (&s);
+      fprintf (stderr, "Clipped %lld times, %lld sweeps, %lld needing more than one sweep, %lld splits\n", s.clips, s.passes, s.repeats, s.splits);
+    }
+
   poptFreeContext (optCon);
 
   return 0;
@@ -28,32 +28,45 @@ extern int places;
 // Types
 
 typedef struct stl_s stl_t;
+typedef struct stl_vertex_s stl_vertex_t;
 typedef struct facet_s facet_t;
+typedef struct stl_zindex_s stl_zindex_t;
 typedef struct slice_s slice_t;
 
 struct stl_s
 {				// STL object
   const char *filename;
   const char *name;
-  int count;
+  int count;			// Number of facets
+  int vcount;			// Number of vertices
   struct
   {
     poly_dim_t x, y, z;
   } min, max;
-  facet_t *facets;
+  stl_vertex_t *vertices;	// Shared vertex table
+  facet_t *facets;		// Array of facets
+  int *adjacent;		// Facet on other side of each edge, 3 per facet, -1 if none (edge n is from vertex n to n+1)
+  stl_zindex_t *zindex;		// Facets in order of lowest Z, see stl_index
   slice_t *slices;
   polygon_t *border;		// total outline of all layers
   polygon_t *anchor;		// Anchor extrude path
   polygon_t *anchorjoin;	// The joining part of anchor
 };
 
+struct stl_vertex_s
+{				// Vertex, shared by all facets that use it
+  poly_dim_t x, y, z;
+};
+
 struct facet_s
 {				// Triangular facet
-  facet_t *next;
-  struct
-  {
-    poly_dim_t x, y, z;
-  } vertex[3];
+  int vertex[3];		// Index in to vertices
+};
+
+struct stl_zindex_s
+{				// Z range of a facet
+  poly_dim_t min, max;
+  int facet;
 };
 
 enum 
@@ -68,6 +81,7 @@ struct slice_s
 {				// main 2D slice of an STL, defines the areas for the slice
   slice_t *next;
   poly_dim_t z;
+  int loose;			// Segments not joined to next by facet adjacency
   polygon_t *outline;		// Outline of layer - from slice
   polygon_t *fill;		// Inside of perimeter
   polygon_t *infill;		// Sparse fill
@@ -80,6 +94,7 @@ struct slice_s
 // Variables
 extern int debug;
 extern int places;
+extern int threads;		// Worker threads, 0 for one per CPU
 #ifdef  FIXED
 extern poly_dim_t fixed, fixplaces;
 #endif
@@ -91,8 +106,10 @@ extern poly_dim_t fixed, fixplaces;
 
 // Common functions
 void *mymalloc (size_t n);	// alloc with fatal error if no space, and clearing content to zero
+int workers (void);		// number of worker threads to use
+void parallel (int n, void (*fn) (void *, int), void *arg);	// run fn(arg,i) for i 0 to n-1 across worker threads
 #define dimout(v) dimplaces(v,places)
-char *dimplaces (poly_dim_t v, int places);	// Output a dimension (static char space used)
+char *dimplaces (poly_dim_t v, int places);	// Output a dimension (static char space used, per thread)
 #ifdef	FIXED
 #define	dim2d(v)	((long double)(v)/fixed)
 #define	d2dim(v)	((v)*fixed)
@@ -101,7 +118,15 @@ char *dimplaces (poly_dim_t v, int places);	// Output a dimension (static char s
 #define	d2dim(v)	(v)
 #endif
 polygon_t *poly_sub (polygon_t * a, polygon_t * b);	// subtract a polygon
-void poly_order (polygon_t * p, poly_dim_t * xp, poly_dim_t * yp);	// reorder contours
+typedef struct grid_s grid_t;	// Uniform grid of points, for nearest point
+grid_t *grid_new (poly_dim_t minx, poly_dim_t miny, poly_dim_t maxx, poly_dim_t maxy, int n, int ids);	// grid for about n points in box, numbered 0 to ids-1
+void grid_free (grid_t *);
+void grid_add (grid_t *, int i, poly_dim_t x, poly_dim_t y, unsigned long long key);	// add point i, key breaks ties
+void grid_remove (grid_t *, int i);	// remove point i
+void grid_key (grid_t *, int i, unsigned long long key);	// change key of point i
+int grid_count (grid_t *);	// points in grid
+int grid_nearest (grid_t *, poly_dim_t x, poly_dim_t y);	// closest point, by whole units of distance, lowest key on a tie, -1 if none
+void poly_order (polygon_t * p, poly_dim_t * xp, poly_dim_t * yp, int ms);	// reorder contours for less travel, improving for up to ms milliseconds
 
 // Extra polygon functions
 
@@ -37,6 +37,233 @@ MALLOC (size_t n)
   return r;
 }
 
+int poly_inset_capsule = 0;	// Use the old capsule method for poly_inset
+
+static poly_stats_t stats;	// updated atomically as clips may be in parallel
+
+void
+poly_stats (poly_stats_t * s)
+{				// Get statistics so far
+  *s = stats;
+}
+
+// Arena allocator
+typedef struct poly_block_s poly_block_t;
+struct poly_block_s
+{
+  poly_block_t *next;
+};
+#define	POLY_BLOCK	65536	// Normal block size
+#define	POLY_ALIGN(n)	(((n)+15)&~15)
+#define	POLY_RADIX	32	// Segments to sort above which a radix sort is used
+#define	POLY_ARC	8	// Steps in a half circle for round joins in poly_inset
+#define	POLY_BATCH	4096	// Vertices in separate groups of contours to clip in one sweep
+
+struct poly_arena_s
+{
+  poly_block_t *blocks;		// blocks allocated, current first
+  char *free;			// free space in current block
+  size_t left;			// bytes left in current block
+};
+
+poly_arena_t *
+poly_arena_new (void)
+{				// New empty arena
+  return MALLOC (sizeof (poly_arena_t));
+}
+
+void *
+poly_arena_alloc (poly_arena_t * arena, size_t n)
+{				// Zeroed space from arena, blocks are calloced and never reused so no need to clear
+  n = POLY_ALIGN (n ? : 1);
+  if (n > POLY_BLOCK / 4)
+    {				// big, own block, after current
+      poly_block_t *b = MALLOC (POLY_ALIGN (sizeof (*b)) + n);
+      if (arena->blocks)
+	{
+	  b->next = arena->blocks->next;
+	  arena->blocks->next = b;
+	}
+      else
+	arena->blocks = b;
+      return (char *) b + POLY_ALIGN (sizeof (*b));
+    }
+  if (n > arena->left)
+    {				// new block
+      poly_block_t *b = MALLOC (POLY_ALIGN (sizeof (*b)) + POLY_BLOCK);
+      b->next = arena->blocks;
+      arena->blocks = b;
+      arena->free = (char *) b + POLY_ALIGN (sizeof (*b));
+      arena->left = POLY_BLOCK;
+    }
+  void *r = arena->free;
+  arena->free += n;
+  arena->left -= n;
+  return r;
+}
+
+void
+poly_arena_free (poly_arena_t * arena)
+{				// Free arena and everything allocated from it
+  if (!arena)
+    return;
+  while (arena->blocks)
+    {
+      poly_block_t *b = arena->blocks;
+      arena->blocks = b->next;
+      free (b);
+    }
+  free (arena);
+}
+
+static inline int
+poly_redundant (poly_dim_t ax, poly_dim_t ay, poly_dim_t bx, poly_dim_t by, poly_dim_t cx, poly_dim_t cy)
+{				// B is a loop back or a mid point on A-C
+#ifdef	POLY_FLOAT
+  poly_dim_t e = ax;		// work out a sensible epsilon
+  if (bx > e)
+    e = bx;
+  if (cx > e)
+    e = cx;
+  if (ay > e)
+    e = ay;
+  if (by > e)
+    e = by;
+  if (cy > e)
+    e = cy;
+  e /= (1LL << 50);
+#else
+  poly_dim_t e = 1;		// easy when not floating point
+#endif
+  poly_dim_t d2 = -1;
+  return (bx == cx && by == cy) || !poly_intersect_point (ax, ay, cx, cy, bx, by, NULL, NULL, NULL, &d2, NULL) || d2 <= e;
+}
+
+// Packed polygons
+poly_packed_t *
+poly_packed_new (poly_arena_t * arena, int contours, int vertices)
+{				// New empty packed polygon with space for specified contours and vertices
+  poly_packed_t *p = poly_arena_alloc (arena, sizeof (*p));
+  p->maxcontours = contours;
+  p->maxvertices = vertices;
+  p->start = poly_arena_alloc (arena, (contours + 1) * sizeof (*p->start));
+  p->dir = poly_arena_alloc (arena, contours * sizeof (*p->dir));
+  p->clipped = poly_arena_alloc (arena, contours * sizeof (*p->clipped));
+  p->x = poly_arena_alloc (arena, vertices * sizeof (*p->x));
+  p->y = poly_arena_alloc (arena, vertices * sizeof (*p->y));
+  p->flag = poly_arena_alloc (arena, vertices * sizeof (*p->flag));
+  return p;
+}
+
+void
+poly_packed_start (poly_packed_t * p)
+{				// Start of new contour
+  if (p->contours && p->start[p->contours - 1] == p->vertices)
+    return;			// current contour is still empty
+  if (p->contours == p->maxcontours)
+    errx (1, "Packed polygon has too many contours");
+  p->start[++p->contours] = p->vertices;
+}
+
+void
+poly_packed_add (poly_packed_t * p, poly_dim_t x, poly_dim_t y, int flag)
+{				// Add point to end of contour
+  if (!p->contours)
+    poly_packed_start (p);
+  if (p->vertices == p->maxvertices)
+    errx (1, "Packed polygon has too many vertices");
+  p->x[p->vertices] = x;
+  p->y[p->vertices] = y;
+  p->flag[p->vertices] = flag;
+  p->start[p->contours] = ++p->vertices;
+}
+
+poly_packed_t *
+poly_pack (poly_arena_t * arena, polygon_t * poly)
+{				// Make packed copy of polygon
+  int contours = 0, vertices = 0;
+  poly_contour_t *c;
+  poly_vertex_t *v;
+  if (poly)
+    for (c = poly->contours; c; c = c->next)
+      {
+	contours++;
+	for (v = c->vertices; v; v = v->next)
+	  vertices++;
+      }
+  poly_packed_t *p = poly_packed_new (arena, contours, vertices);
+  if (poly)
+    for (c = poly->contours; c; c = c->next)
+      {
+	poly_packed_start (p);
+	p->dir[p->contours - 1] = c->dir;
+	p->clipped[p->contours - 1] = c->clipped;
+	for (v = c->vertices; v; v = v->next)
+	  poly_packed_add (p, v->x, v->y, v->flag);
+      }
+  return p;
+}
+
+polygon_t *
+poly_unpack (poly_packed_t * p)
+{				// Make new malloced polygon from packed polygon
+  polygon_t *poly = poly_new ();
+  int c, v;
+  for (c = p->contours - 1; c >= 0; c--)
+    {				// poly_add adds contours at the start, so work backwards
+      poly_start (poly);
+      if (p->start[c] == p->start[c + 1])
+	continue;
+      for (v = p->start[c]; v < p->start[c + 1]; v++)
+	poly_add (poly, p->x[v], p->y[v], p->flag[v]);
+      poly->contours->dir = p->dir[c];
+      poly->contours->clipped = p->clipped[c];
+    }
+  return poly;
+}
+
+static void
+poly_packed_tidy (poly_packed_t * p)
+{				// Remove dead ends and redundant midpoints in situ, and remove contours of <3 vertices (as poly_tidy with no tolerance)
+  int c, o = 0, oc = 0;
+  for (c = 0; c < p->contours; c++)
+    {
+      int s = p->start[c], n = p->start[c + 1] - s, i, t = 0, b = 0;
+      poly_dim_t *x = p->x + s, *y = p->y + s;
+      int *flag = p->flag + s;
+      for (i = 0; i < n; i++)
+	{			// single pass, keeping those so far as a stack, popping any made redundant by the next
+	  while (t >= 2 && poly_redundant (x[t - 2], y[t - 2], x[t - 1], y[t - 1], x[i], y[i]))
+	    t--;
+	  x[t] = x[i];
+	  y[t] = y[i];
+	  flag[t++] = flag[i];
+	}
+      while (t - b >= 3)
+	{			// where it wraps round
+	  if (poly_redundant (x[t - 2], y[t - 2], x[t - 1], y[t - 1], x[b], y[b]))
+	    t--;
+	  else if (poly_redundant (x[t - 1], y[t - 1], x[b], y[b], x[b + 1], y[b + 1]))
+	    b++;
+	  else
+	    break;
+	}
+      n = t - b;
+      if (n < 3)
+	continue;
+      memmove (p->x + o, x + b, n * sizeof (*x));
+      memmove (p->y + o, y + b, n * sizeof (*y));
+      memmove (p->flag + o, flag + b, n * sizeof (*flag));
+      p->dir[oc] = p->dir[c];
+      p->clipped[oc] = p->clipped[c];
+      p->start[oc++] = o;
+      o += n;
+    }
+  p->contours = oc;
+  p->vertices = o;
+  p->start[oc] = o;
+}
+
 // General functions
 polygon_t *
 poly_new (void)
@@ -72,6 +299,43 @@ poly_free (polygon_t * poly)
   free (poly);
 }
 
+int
+poly_box (polygon_t * poly, poly_dim_t * minx, poly_dim_t * miny, poly_dim_t * maxx, poly_dim_t * maxy)
+{				// Bounding box of polygon, returns 0 if no vertices
+  int n = 0;
+  poly_contour_t *c;
+  poly_vertex_t *v;
+  if (poly)
+    for (c = poly->contours; c; c = c->next)
+      for (v = c->vertices; v; v = v->next)
+	{
+	  if (!n++)
+	    {
+	      *minx = *maxx = v->x;
+	      *miny = *maxy = v->y;
+	      continue;
+	    }
+	  if (v->x < *minx)
+	    *minx = v->x;
+	  if (v->x > *maxx)
+	    *maxx = v->x;
+	  if (v->y < *miny)
+	    *miny = v->y;
+	  if (v->y > *maxy)
+	    *maxy = v->y;
+	}
+  return n;
+}
+
+int
+poly_overlap (polygon_t * a, polygon_t * b)
+{				// Non zero if the bounding boxes of a and b overlap
+  poly_dim_t aminx, aminy, amaxx, amaxy, bminx, bminy, bmaxx, bmaxy;
+  if (!poly_box (a, &aminx, &aminy, &amaxx, &amaxy) || !poly_box (b, &bminx, &bminy, &bmaxx, &bmaxy))
+    return 0;
+  return aminx <= bmaxx && bminx <= amaxx && aminy <= bmaxy && bminy <= amaxy;
+}
+
 void
 poly_start (polygon_t * poly)
 {				// Add new empty contour to start of polygon
@@ -105,46 +369,45 @@ poly_tidy (polygon_t * poly, poly_dim_t tolerance)
 {				// Remove dead ends and redundant midpoints from contours in situ, and remove contours of <3 vertices
   if (!poly)
     return;
+  poly_vertex_t **stack = NULL;
+  int max = 0;
   poly_contour_t **cc = &poly->contours;
   while (*cc)
     {
       poly_contour_t *contour = *cc;
 
-      // remove loop backs and min points
-      poly_vertex_t *a = contour->vertices;
-      while (a)
+      // remove loop backs and mid points, single pass keeping those so far as a stack, popping any made redundant by the next
+      poly_vertex_t *a, *next;
+      int n = 0, t = 0, b = 0;
+      for (a = contour->vertices; a; a = a->next)
+	n++;
+      if (n > max)
 	{
-	  poly_vertex_t *b = (a->next ? : contour->vertices);
-	  poly_vertex_t *c = (b->next ? : contour->vertices);
-#ifdef	POLY_FLOAT
-	  poly_dim_t e = a->x;	// work out a sensible epsilon
-	  if (b->x > e)
-	    e = b->x;
-	  if (c->x > e)
-	    e = c->x;
-	  if (a->y > e)
-	    e = a->y;
-	  if (b->y > e)
-	    e = b->y;
-	  if (c->y > e)
-	    e = c->y;
-	  e /= (1LL << 50);
-#else
-	  poly_dim_t e = 1;	// easy when not floating point
-#endif
-	  poly_dim_t d2 = -1;
-	  if ((b->x == c->x && b->y == c->y) || !poly_intersect_point (a->x, a->y, c->x, c->y, b->x, b->y, NULL, NULL, NULL, &d2, NULL) || d2 <= e)
-	    {
-	      if (a->next)
-		a->next = b->next;
-	      else
-		contour->vertices = b->next;
-	      free (b);
-	      a = contour->vertices;	// start again, annoying as only need to go back one step really.
-	      continue;
-	    }
-	  a = a->next;
+	  free (stack);
+	  stack = MALLOC ((max = n) * sizeof (*stack));
+	}
+      for (a = contour->vertices; a; a = next)
+	{
+	  next = a->next;
+	  while (t >= 2 && poly_redundant (stack[t - 2]->x, stack[t - 2]->y, stack[t - 1]->x, stack[t - 1]->y, a->x, a->y))
+	    free (stack[--t]);
+	  stack[t++] = a;
+	}
+      while (t - b >= 3)
+	{			// where it wraps round
+	  if (poly_redundant (stack[t - 2]->x, stack[t - 2]->y, stack[t - 1]->x, stack[t - 1]->y, stack[b]->x, stack[b]->y))
+	    free (stack[--t]);
+	  else if (poly_redundant (stack[t - 1]->x, stack[t - 1]->y, stack[b]->x, stack[b]->y, stack[b + 1]->x, stack[b + 1]->y))
+	    free (stack[b++]);
+	  else
+	    break;
 	}
+      // only write links that change, so tidying an already tidy polygon does not write to it
+      if (contour->vertices != (t > b ? stack[b] : NULL))
+	contour->vertices = (t > b ? stack[b] : NULL);
+      for (n = b; n < t; n++)
+	if (stack[n]->next != (n + 1 < t ? stack[n + 1] : NULL))
+	  stack[n]->next = (n + 1 < t ? stack[n + 1] : NULL);
 
       if (tolerance)
 	{			// smooth - subtly different as accumulates errors to avoid removing a string of small steps
@@ -163,6 +426,7 @@ poly_tidy (polygon_t * poly, poly_dim_t tolerance)
 		  if (poly_intersect_point (a->x, a->y, c->x, c->y, b->x, b->y, NULL, NULL, &ab, NULL, &o) && ab > 0 && ab < 1 && abs (acc + o) < tolerance)
 		    {		// remove point but accumulate effect
 		      acc += o;
+		      contour->clipped = 0;	// no longer exactly as clipped
 		      if (a->next)
 			a->next = b->next;
 		      else
@@ -190,19 +454,159 @@ poly_tidy (polygon_t * poly, poly_dim_t tolerance)
       }
       cc = &contour->next;
     }
+  free (stack);
 }
 
-polygon_t *
-poly_inset (polygon_t * poly, poly_dim_t inset)
-{				// Make new polygon offset from old by the inset distance, inset is +ve to make smaller
+void
+poly_simplify (polygon_t * poly, poly_dim_t tolerance)
+{				// Remove vertices least area first (Visvalingam), keeping every removed vertex within tolerance of the new edges
+  if (!poly || tolerance <= 0)
+    return;
+  poly_tidy (poly, 0);
+  poly_contour_t *contour;
+  for (contour = poly->contours; contour; contour = contour->next)
+    {
+      int n = 0, i;
+      poly_vertex_t *v;
+      for (v = contour->vertices; v; v = v->next)
+	n++;
+      poly_vertex_t **vertex = MALLOC (n * sizeof (*vertex));
+      int *prev = MALLOC (n * sizeof (*prev));
+      int *next = MALLOC (n * sizeof (*next));
+      int *heap = MALLOC (n * sizeof (*heap));
+      int *pos = MALLOC (n * sizeof (*pos));	// position in heap, -1 if not in it
+      long double *area = MALLOC (n * sizeof (*area));
+      long double *err = MALLOC (n * sizeof (*err));	// how far removed vertices may be from edge to next
+      int heaps = 0, left = n;
+      for (i = 0, v = contour->vertices; v; v = v->next, i++)
+	{
+	  vertex[i] = v;
+	  prev[i] = (i ? i - 1 : n - 1);
+	  next[i] = (i + 1 < n ? i + 1 : 0);
+	}
+      void swap (int a, int b)
+      {
+	int t = heap[a];
+	heap[a] = heap[b];
+	heap[b] = t;
+	pos[heap[a]] = a;
+	pos[heap[b]] = b;
+      }
+      void up (int h)
+      {
+	while (h && area[heap[h]] < area[heap[(h - 1) / 2]])
+	  {
+	    swap (h, (h - 1) / 2);
+	    h = (h - 1) / 2;
+	  }
+      }
+      void down (int h)
+      {
+	while (1)
+	  {
+	    int c = h * 2 + 1;
+	    if (c >= heaps)
+	      break;
+	    if (c + 1 < heaps && area[heap[c + 1]] < area[heap[c]])
+	      c++;
+	    if (area[heap[c]] >= area[heap[h]])
+	      break;
+	    swap (h, c);
+	    h = c;
+	  }
+      }
+      void update (int i)
+      {				// work out area of triangle with neighbours, and (re)place in heap
+	poly_vertex_t *a = vertex[prev[i]], *b = vertex[i], *c = vertex[next[i]];
+	area[i] = fabsl ((long double) (b->x - a->x) * (c->y - b->y) - (long double) (b->y - a->y) * (c->x - b->x));
+	if (pos[i] < 0)
+	  {
+	    pos[i] = heaps;
+	    heap[heaps++] = i;
+	    up (pos[i]);
+	  }
+	else
+	  {
+	    up (pos[i]);
+	    down (pos[i]);
+	  }
+      }
+      for (i = 0; i < n; i++)
+	{
+	  pos[i] = -1;
+	  err[i] = 0;
+	}
+      for (i = 0; i < n; i++)
+	update (i);
+      while (heaps && left > 3)
+	{
+	  i = heap[0];
+	  swap (0, --heaps);
+	  down (0);
+	  pos[i] = -1;
+	  poly_vertex_t *a = vertex[prev[i]], *b = vertex[i], *c = vertex[next[i]];
+	  poly_dim_t d2 = 0;
+	  long double ab = 0;
+	  long double e = (err[prev[i]] > err[i] ? err[prev[i]] : err[i]);
+	  if (poly_intersect_point (a->x, a->y, c->x, c->y, b->x, b->y, NULL, NULL, &ab, &d2, NULL) && ab > 0 && ab < 1)
+	    e += sqrtl (d2);	// distance from new edge
+	  else if (ab >= 1)
+	    e += sqrtl ((b->x - c->x) * (b->x - c->x) + (b->y - c->y) * (b->y - c->y));	// past end, so distance from end
+	  else
+	    e += sqrtl ((b->x - a->x) * (b->x - a->x) + (b->y - a->y) * (b->y - a->y));
+	  if (e > tolerance)
+	    continue;		// stays, unless a neighbour goes and it is checked again
+	  err[prev[i]] = e;
+	  next[prev[i]] = next[i];
+	  prev[next[i]] = prev[i];
+	  vertex[i] = NULL;
+	  free (b);
+	  left--;
+	  contour->clipped = 0;	// no longer exactly as clipped
+	  update (prev[i]);
+	  update (next[i]);
+	}
+      // relink what is left, in order
+      for (i = 0; !vertex[i]; i++);
+      contour->vertices = vertex[i];
+      int j;
+      for (j = next[i]; j != i; j = next[j])
+	{
+	  vertex[prev[j]]->next = vertex[j];
+	  vertex[j]->next = NULL;
+	}
+      free (vertex);
+      free (prev);
+      free (next);
+      free (heap);
+      free (pos);
+      free (area);
+      free (err);
+    }
+}
+
+static polygon_t *
+poly_inset_capsules (polygon_t * poly, poly_dim_t inset, poly_dim_t width)
+{				// Inset by union of a thick line for each edge, then difference and intersect with original
   // This is a convoluted way to do it but reliable.
-  if (!poly || !poly->contours)
-    return poly_new ();
-  poly_dim_t width = (inset < 0 ? 0 - inset : inset);
-  poly_tidy (poly, width / 20);
-  polygon_t *border = poly_new ();
+  poly_arena_t *arena = poly_arena_new ();
   poly_contour_t *contour;
   poly_vertex_t *a;
+  int edges = 0;
+  for (contour = poly->contours; contour; contour = contour->next)
+    for (a = contour->vertices; a; a = a->next)
+      edges++;
+  // Border is a thick line for each edge, in reverse order as poly_add would have made them
+  poly_packed_t *border = poly_packed_new (arena, edges, edges * 8);
+  border->contours = edges;
+  border->vertices = edges * 8;
+  int e = edges;
+  void add (int n, poly_dim_t x, poly_dim_t y, int flag)
+  {
+    border->x[e * 8 + n] = x;
+    border->y[e * 8 + n] = y;
+    border->flag[e * 8 + n] = flag;
+  }
   for (contour = poly->contours; contour; contour = contour->next)
     for (a = contour->vertices; a; a = a->next)
       {
@@ -213,26 +617,30 @@ poly_inset (polygon_t * poly, poly_dim_t inset)
 	dx = width * dx / l;
 	dy = width * dy / l;
 	// now add a thicker version of this line
-	poly_start (border);
-	poly_add (border, b->x - dy, b->y + dx, a->flag);
-	poly_add (border, b->x - dy / 2 + dx * 866 / 1000, b->y + dx / 2 + dy * 866 / 1000, a->flag);
-	poly_add (border, b->x + dy / 2 + dx * 866 / 1000, b->y - dx / 2 + dy * 866 / 1000, a->flag);
-	poly_add (border, b->x + dy, b->y - dx, a->flag);
-	poly_add (border, a->x + dy, a->y - dx, a->flag);
-	poly_add (border, a->x + dy / 2 - dx * 866 / 1000, a->y - dx / 2 - dy * 866 / 1000, a->flag);
-	poly_add (border, a->x - dy / 2 - dx * 866 / 1000, a->y + dx / 2 - dy * 866 / 1000, a->flag);
-	poly_add (border, a->x - dy, a->y + dx, a->flag);
+	e--;
+	border->start[e] = e * 8;
+	border->start[e + 1] = e * 8 + 8;
+	add (0, b->x - dy, b->y + dx, a->flag);
+	add (1, b->x - dy / 2 + dx * 866 / 1000, b->y + dx / 2 + dy * 866 / 1000, a->flag);
+	add (2, b->x + dy / 2 + dx * 866 / 1000, b->y - dx / 2 + dy * 866 / 1000, a->flag);
+	add (3, b->x + dy, b->y - dx, a->flag);
+	add (4, a->x + dy, a->y - dx, a->flag);
+	add (5, a->x + dy / 2 - dx * 866 / 1000, a->y - dx / 2 - dy * 866 / 1000, a->flag);
+	add (6, a->x - dy / 2 - dx * 866 / 1000, a->y + dx / 2 - dy * 866 / 1000, a->flag);
+	add (7, a->x - dy, a->y + dx, a->flag);
       }
   if (inset < 0)
     {				// outset
-      polygon_t *out = poly_clip (POLY_UNION, 2, border, poly);
-      poly_free (border);
+      poly_tidy (poly, 0);
+      poly_packed_t *both[2] = { border, poly_pack (arena, poly) };
+      polygon_t *out = poly_clip_packed (POLY_UNION, 2, both);
+      poly_arena_free (arena);
       poly_tidy (out, width / 20);
       return out;
     }
   //inset
-  polygon_t *thick = poly_clip (POLY_UNION, 1, border);
-  poly_free (border);
+  polygon_t *thick = poly_clip_packed (POLY_UNION, 1, &border);
+  poly_arena_free (arena);
   polygon_t *diff = poly_clip (POLY_DIFFERENCE, 2, thick, poly);
   poly_free (thick);
   polygon_t *out = poly_clip (POLY_INTERSECT, 2, diff, poly);
@@ -241,11 +649,181 @@ poly_inset (polygon_t * poly, poly_dim_t inset)
   return out;
 }
 
+void
+poly_inset_multi (polygon_t * poly, const poly_dim_t * inset, int n, polygon_t ** out)
+{				// Make new polygons offset from the same original by each inset distance, sharing the edge geometry
+  int i;
+  if (!poly || !poly->contours)
+    {
+      for (i = 0; i < n; i++)
+	out[i] = poly_new ();
+      return;
+    }
+  poly_dim_t tolerance = 0;
+  for (i = 0; i < n; i++)
+    {
+      if (!i || ABS (inset[i]) < tolerance)
+	tolerance = ABS (inset[i]);
+    }
+  poly_tidy (poly, tolerance / 20);
+  if (poly_inset_capsule)
+    {
+      for (i = 0; i < n; i++)
+	out[i] = poly_inset_capsules (poly, inset[i], ABS (inset[i]));
+      return;
+    }
+  // Offset each edge to the right (inside), join with an arc (or miter if small) where they part, or back via the
+  // original vertex where they overlap, and let a union remove the overlaps as they wind the wrong way
+  poly_contour_t *contour;
+  poly_vertex_t *a;
+  int contours = 0, vertices = 0;
+  for (contour = poly->contours; contour; contour = contour->next)
+    {
+      contours++;
+      for (a = contour->vertices; a; a = a->next)
+	vertices++;
+    }
+  typedef struct corner_s corner_t;
+  struct corner_s
+  {				// Geometry at each vertex, independent of inset
+    poly_vertex_t *a;
+    int flag;			// flag of previous vertex, i.e. of the incoming edge
+    long double x0, y0, x1, y1;	// unit direction of incoming and outgoing edge
+    long double l0, l1;		// length of incoming and outgoing edge
+    long double cross, dot, angle;
+  };
+  corner_t *corner = MALLOC (vertices * sizeof (*corner) + 1);
+  int *start = MALLOC ((contours + 1) * sizeof (*start));
+  int v = 0;
+  contours = 0;
+  for (contour = poly->contours; contour; contour = contour->next)
+    {
+      start[contours++] = v;
+      poly_vertex_t *z = contour->vertices;	// previous vertex
+      while (z->next)
+	z = z->next;
+      for (a = contour->vertices; a; z = a, a = a->next)
+	{
+	  poly_vertex_t *b = (a->next ? : contour->vertices);
+	  corner_t *c = corner + v;
+	  c->x0 = a->x - z->x;
+	  c->y0 = a->y - z->y;
+	  c->x1 = b->x - a->x;
+	  c->y1 = b->y - a->y;
+	  c->l0 = sqrtl (c->x0 * c->x0 + c->y0 * c->y0);
+	  c->l1 = sqrtl (c->x1 * c->x1 + c->y1 * c->y1);
+	  if (!c->l0 || !c->l1)
+	    continue;
+	  c->x0 /= c->l0;
+	  c->y0 /= c->l0;
+	  c->x1 /= c->l1;
+	  c->y1 /= c->l1;
+	  c->cross = c->x0 * c->y1 - c->y0 * c->x1;
+	  c->dot = c->x0 * c->x1 + c->y0 * c->y1;
+	  c->angle = atan2l (c->cross, c->dot);
+	  c->a = a;
+	  c->flag = z->flag;
+	  v++;
+	}
+    }
+  start[contours] = v;
+  int empty = -1;		// an inset that left nothing, so any larger one will too
+  for (i = 0; i < n; i++)
+    {
+      poly_dim_t d = inset[i];
+      if (empty >= 0 && d >= inset[empty])
+	{
+	  out[i] = poly_new ();
+	  continue;
+	}
+      poly_arena_t *arena = poly_arena_new ();
+      poly_packed_t *offset = poly_packed_new (arena, contours, v * (POLY_ARC + 2));
+      int k;
+      for (k = 0; k < contours; k++)
+	{
+	  poly_packed_start (offset);
+	  corner_t *c;
+	  for (c = corner + start[k]; c < corner + start[k + 1]; c++)
+	    {
+	      long double nx0 = d * c->y0, ny0 = -d * c->x0, nx1 = d * c->y1, ny1 = -d * c->x1;	// normals, scaled
+	      inline void add (long double dx, long double dy, int flag)
+	      {
+		poly_packed_add (offset, c->a->x + llroundl (dx), c->a->y + llroundl (dy), flag);
+	      }
+	      if (c->cross * d > 0)
+		{		// parting, round join
+		  int steps = ceill (fabsl (c->angle) * POLY_ARC / M_PI), n;
+		  if (steps <= 1)
+		    add ((nx0 + nx1) / (1 + c->dot), (ny0 + ny1) / (1 + c->dot), c->flag);	// miter
+		  else
+		    for (n = 0; n < steps; n++)
+		      {
+			long double s = sinl (c->angle * n / steps), co = cosl (c->angle * n / steps);
+			add (nx0 * co - ny0 * s, nx0 * s + ny0 * co, c->flag);
+		      }
+		}
+	      else if (c->dot > 0 && fabsl (d * c->cross) / (1 + c->dot) * 2 <= MIN (c->l0, c->l1))
+		{		// overlap, but edges cross well within their length, so just use that
+		  add ((nx0 + nx1) / (1 + c->dot), (ny0 + ny1) / (1 + c->dot), c->a->flag);
+		  continue;
+		}
+	      else
+		{		// overlap, go back via vertex
+		  add (nx0, ny0, c->flag);
+		  add (0, 0, c->flag);
+		}
+	      add (nx1, ny1, c->a->flag);
+	    }
+	}
+      out[i] = poly_clip_packed (POLY_UNION, 1, &offset);
+      poly_arena_free (arena);
+      poly_tidy (out[i], ABS (d) / 20);
+      if (d > 0 && !out[i]->contours && (empty < 0 || d < inset[empty]))
+	empty = i;
+    }
+  free (start);
+  free (corner);
+}
+
+polygon_t *
+poly_inset (polygon_t * poly, poly_dim_t inset)
+{				// Make new polygon offset from old by the inset distance, inset is +ve to make smaller
+  polygon_t *out;
+  poly_inset_multi (poly, &inset, 1, &out);
+  return out;
+}
+
 polygon_t *
 poly_clip (int operation, int count, polygon_t * poly, ...)
 {				// return set of simple contours from one or more input polygons
+  polygon_t *polys[count];
+  va_list ap;
+  va_start (ap, poly);
+  int n;
+  for (n = 0; n < count; n++)
+    polys[n] = (n ? va_arg (ap, polygon_t *) : poly);
+  va_end (ap);
+  return poly_clipn (operation, count, polys);
+}
+
+polygon_t *
+poly_clipn (int operation, int count, polygon_t ** polys)
+{				// as poly_clip, from an array of polygons
+  poly_arena_t *arena = poly_arena_new ();
+  poly_packed_t **packed = poly_arena_alloc (arena, count * sizeof (*packed));
+  int n;
+  for (n = 0; n < count; n++)
+    packed[n] = poly_pack (arena, polys[n]);	// poly_clip_packed tidies the packed copy
+  polygon_t *new = poly_clip_packed (operation, count, packed);
+  poly_arena_free (arena);
+  return new;
+}
+
+static polygon_t *
+poly_clip_sweep (int operation, int count, poly_packed_t ** packed)
+{				// return set of simple contours from one or more tidied input polygons
   //fprintf (stderr, "Poly clip operation %d on %d polygons\n", operation, count);
-  polygon_t *new = poly_new ();
+  poly_arena_t *arena = poly_arena_new ();	// all working space, freed at end
   typedef struct segment_s segment_t;
   struct segment_s
   {
@@ -253,75 +831,168 @@ poly_clip (int operation, int count, polygon_t * poly, ...)
     int flag;			// sum of flag
     int dir;			// +ve for a->b, -ve for b->a, may be more than 1 if accumulated segments
     poly_dim_t ax, ay, bx, by;	// ax<bx, or same and ay<by
+    int seq;			// order added to sweep, or to queue
+    short sub;			// part of dir from polygons after the first, for POLY_SUBTRACT
+    char insweep;		// in sweep tree
+    char moved;			// split moved off its original line, to check against its neighbours again
   };
+  typedef struct node_s node_t;
+  struct node_s
+  {				// sweep tree node (treap in Y order along the sweep line) and end X heap position for segment, indexed by seq
+    segment_t *s;
+    int left, right, up;	// sub trees and parent, -1 for none
+    int heap;			// position in active heap
+    unsigned int priority;	// tree balancing
+  };
+  node_t *node = NULL;
+  int maxnode = 0;
+  int tree = -1;		// sweep tree root
+  int *active = NULL;		// heap of nodes in sweep tree by end X
+  int actives = 0;
+  segment_t **queue = NULL;	// heap of fragments by start X, last in first out
+  int queues = 0, maxqueue = 0;
+  segment_t **moved = NULL;	// segments in sweep tree to check again
+  int moves = 0, maxmoved = 0;
   segment_t *stage1 = NULL;
   int segcount = 0;
-  polygon_t *q = poly;
-  poly_vertex_t *a;
-  va_list ap;
-  va_start (ap, poly);
-  int polies = count;
-  while (polies--)
+  int polies;
+  for (polies = 0; polies < count; polies++)
     {
-      poly_tidy (q, 0);
-      poly_contour_t *p;
-      if (q)
-	for (p = q->contours; p; p = p->next)
+      poly_packed_t *q = packed[polies];
+      if (!q)
+	continue;
+      int c, a;
+      for (c = 0; c < q->contours; c++)
+	for (a = q->start[c]; a < q->start[c + 1]; a++)
 	  {
-	    for (a = p->vertices; a; a = a->next)
+	    int b = (a + 1 < q->start[c + 1] ? a + 1 : q->start[c]);
+	    segment_t *s = poly_arena_alloc (arena, sizeof (*s));
+	    if (q->x[a] < q->x[b] || (q->x[a] == q->x[b] && q->y[a] < q->y[b]))
 	      {
-		poly_vertex_t *b = (a->next ? : p->vertices);
-		segment_t *s = MALLOC (sizeof (*s));
-		if (a->x < b->x || (a->x == b->x && a->y < b->y))
-		  {
-		    s->ax = a->x;
-		    s->ay = a->y;
-		    s->bx = b->x;
-		    s->by = b->y;
-		    s->dir = 1;
-		  }
-		else
-		  {
-		    s->ax = b->x;
-		    s->ay = b->y;
-		    s->bx = a->x;
-		    s->by = a->y;
-		    s->dir = -1;
-		  }
-		s->flag = a->flag;
-		s->next = stage1;
-		stage1 = s;
-		segcount++;
+		s->ax = q->x[a];
+		s->ay = q->y[a];
+		s->bx = q->x[b];
+		s->by = q->y[b];
+		s->dir = 1;
+	      }
+	    else
+	      {
+		s->ax = q->x[b];
+		s->ay = q->y[b];
+		s->bx = q->x[a];
+		s->by = q->y[a];
+		s->dir = -1;
 	      }
+	    if (polies)
+	      s->sub = s->dir;
+	    s->flag = q->flag[a];
+	    s->next = stage1;
+	    stage1 = s;
+	    segcount++;
 	  }
-      if (count)
-	q = va_arg (ap, polygon_t *);
     }
-  va_end (ap);
+  int order (const void *ap, const void *bp)
+  {				// by start X, start Y, then slope
+    segment_t *a = *(segment_t **) ap;
+    segment_t *b = *(segment_t **) bp;
+    if (a->ax < b->ax)
+      return -1;
+    if (a->ax > b->ax)
+      return 1;
+    if (a->ay < b->ay)
+      return -1;
+    if (a->ay > b->ay)
+      return 1;
+    poly_dim_t d = (b->bx - b->ax) * (a->by - a->ay) - (a->bx - a->ax) * (b->by - b->ay);
+    return (d < 0) ? -1 : (d > 0) ? 1 : 0;
+  }
   segment_t *sortsegs (segment_t * s, int n)
   {
     int p;
     segment_t **index = MALLOC (n * sizeof (*index));
-    for (p = 0; p < n; p++)
+#ifndef	POLY_QSORT
+    if (n > POLY_RADIX)
+      {				// LSD radix sort on start X and Y packed in one key, 11 bits at a time
+	typedef struct
+	{
+	  unsigned long long key;
+	  segment_t *s;
+	} radix_t;
+	radix_t *r = MALLOC (n * sizeof (*r)), *t = MALLOC (n * sizeof (*t));
+	poly_dim_t minx = s->ax, maxx = s->ax, miny = s->ay, maxy = s->ay;
+	for (p = 0; p < n; p++)
+	  {			// X in r and Y in t for now
+	    r[p].s = s;
+	    r[p].key = s->ax;
+	    t[p].key = s->ay;
+	    if (s->ax < minx)
+	      minx = s->ax;
+	    if (s->ax > maxx)
+	      maxx = s->ax;
+	    if (s->ay < miny)
+	      miny = s->ay;
+	    if (s->ay > maxy)
+	      maxy = s->ay;
+	    s = s->next;
+	  }
+	int xbits = 0, ybits = 0, b, i;
+	while (xbits < 64 && ((unsigned long long) (maxx - minx) >> xbits))
+	  xbits++;
+	while (ybits < 64 && ((unsigned long long) (maxy - miny) >> ybits))
+	  ybits++;
+	if (xbits + ybits <= 64)
+	  {
+	    int digits = (xbits + ybits + 10) / 11;
+	    int (*count)[2048] = MALLOC (sizeof (*count) * (digits ? : 1));
+	    for (p = 0; p < n; p++)
+	      {
+		r[p].key = ((r[p].key - minx) << ybits) + (t[p].key - miny);
+		for (b = 0; b < digits; b++)
+		  count[b][(r[p].key >> (b * 11)) & 2047]++;
+	      }
+	    for (b = 0; b < digits; b++)
+	      {
+		if (count[b][(r[0].key >> (b * 11)) & 2047] == n)
+		  continue;	// all the same
+		int c = 0;
+		for (i = 0; i < 2048; i++)
+		  {
+		    int z = count[b][i];
+		    count[b][i] = c;
+		    c += z;
+		  }
+		for (p = 0; p < n; p++)
+		  t[count[b][(r[p].key >> (b * 11)) & 2047]++] = r[p];
+		radix_t *z = r;
+		r = t;
+		t = z;
+	      }
+	    free (count);
+	    for (p = 0; p < n; p++)
+	      {			// insertion sort of runs of same start point by slope
+		radix_t v = r[p];
+		for (i = p; i && r[i - 1].key == v.key && order (&r[i - 1].s, &v.s) > 0; i--)
+		  r[i] = r[i - 1];
+		r[i] = v;
+	      }
+	  }
+	for (p = 0; p < n; p++)
+	  index[p] = r[p].s;
+	if (xbits + ybits > 64)
+	  qsort (index, n, sizeof (*index), order);	// too big a range to pack in one key
+	free (t);
+	free (r);
+      }
+    else
+#endif
       {
-	index[p] = s;
-	s = s->next;
+	for (p = 0; p < n; p++)
+	  {
+	    index[p] = s;
+	    s = s->next;
+	  }
+	qsort (index, n, sizeof (*index), order);
       }
-    int order (const void *ap, const void *bp)
-    {
-      segment_t *a = *(segment_t **) ap;
-      segment_t *b = *(segment_t **) bp;
-      if (a->ax < b->ax)
-	return -1;
-      if (a->ax > b->ax)
-	return 1;
-      if (a->ay < b->ay)
-	return -1;
-      if (a->ay > b->ay)
-	return 1;
-      return (b->bx - b->ax) * (a->by - a->ay) - (a->bx - a->ax) * (b->by - b->ay);
-    }
-    qsort (index, n, sizeof (*index), order);
     segment_t **sp = &s;
     for (p = 0; p < n; p++)
       {
@@ -333,14 +1004,208 @@ poly_clip (int operation, int count, polygon_t * poly, ...)
     return s;
   }
   if (!stage1)
-    return new;
+    {
+      poly_arena_free (arena);
+      return poly_new ();
+    }
+  // Queue of fragments, ordered by start X and last in first out at same X
+  inline int first (segment_t * a, segment_t * b)
+  {
+    return a->ax < b->ax || (a->ax == b->ax && a->seq > b->seq);
+  }
+  void queue_push (segment_t * s)
+  {
+    if (queues == maxqueue)
+      {
+	maxqueue = maxqueue * 2 + 64;
+	queue = realloc (queue, maxqueue * sizeof (*queue));
+	if (!queue)
+	  errx (1, "Cannot allocate queue");
+      }
+    int i = queues++;
+    while (i && first (s, queue[(i - 1) / 2]))
+      {
+	queue[i] = queue[(i - 1) / 2];
+	i = (i - 1) / 2;
+      }
+    queue[i] = s;
+  }
+  segment_t *queue_pop (void)
+  {
+    segment_t *top = queue[0], *s = queue[--queues];
+    int i = 0, c;
+    while ((c = i * 2 + 1) < queues)
+      {
+	if (c + 1 < queues && first (queue[c + 1], queue[c]))
+	  c++;
+	if (!first (queue[c], s))
+	  break;
+	queue[i] = queue[c];
+	i = c;
+      }
+    queue[i] = s;
+    return top;
+  }
+  // Segments in sweep tree, as heap by end X
+  inline int sooner (int a, int b)
+  {
+    return node[a].s->bx < node[b].s->bx;
+  }
+  void active_up (int i)
+  {
+    int n = active[i];
+    while (i && sooner (n, active[(i - 1) / 2]))
+      {
+	active[i] = active[(i - 1) / 2];
+	node[active[i]].heap = i;
+	i = (i - 1) / 2;
+      }
+    active[i] = n;
+    node[n].heap = i;
+  }
+  int active_pop (void)
+  {
+    int top = active[0], n = active[--actives];
+    int i = 0, c;
+    while ((c = i * 2 + 1) < actives)
+      {
+	if (c + 1 < actives && sooner (active[c + 1], active[c]))
+	  c++;
+	if (!sooner (active[c], n))
+	  break;
+	active[i] = active[c];
+	node[active[i]].heap = i;
+	i = c;
+      }
+    active[i] = n;
+    node[n].heap = i;
+    return top;
+  }
+  // Sweep tree, a treap of the segments crossing the sweep line in Y order, which do not cross each other as any that would
+  // have been split, so only segments next to each other in the tree need checking (Bentley-Ottmann). A vertical segment
+  // goes in at its lower end, as the steepest there, and is split by each it crosses in turn as the pieces go in
+  inline int above (segment_t * q, segment_t * s)
+  {				// q, starting on the sweep line, goes above s in the sweep tree
+    if (s->ax == s->bx)
+      return q->ay > s->ay || (q->ay == s->ay && q->ax == q->bx && q->seq > s->seq);
+    poly_dim_t d = (q->ay - s->ay) * (s->bx - s->ax) - (s->by - s->ay) * (q->ax - s->ax);
+    if (d)
+      return d > 0;
+    if (s->bx == q->ax)
+      return 1;			// s ends where q starts, those ending go below those starting
+    d = (q->by - q->ay) * (s->bx - s->ax) - (s->by - s->ay) * (q->bx - q->ax);
+    if (d)
+      return d > 0;
+    return q->seq > s->seq;
+  }
+  inline int through (segment_t * s, poly_dim_t x, poly_dim_t y)
+  {				// s is exactly on x,y
+    if (s->ax == s->bx)
+      return x == s->ax && y >= s->ay && y <= s->by;
+    return (y - s->ay) * (s->bx - s->ax) == (s->by - s->ay) * (x - s->ax);
+  }
+  void tree_rotate (int n)
+  {				// rotate n above its parent
+    int p = node[n].up, g = node[p].up, c;
+    if (node[p].left == n)
+      {
+	c = node[p].left = node[n].right;
+	node[n].right = p;
+      }
+    else
+      {
+	c = node[p].right = node[n].left;
+	node[n].left = p;
+      }
+    if (c >= 0)
+      node[c].up = p;
+    node[p].up = n;
+    node[n].up = g;
+    if (g < 0)
+      tree = n;
+    else if (node[g].left == p)
+      node[g].left = n;
+    else
+      node[g].right = n;
+  }
+  void tree_attach (int n, int up, int *tp)
+  {				// put n in the tree at leaf tp under up
+    *tp = n;
+    node[n].up = up;
+    while (node[n].up >= 0 && node[node[n].up].priority < node[n].priority)
+      tree_rotate (n);
+  }
+  void tree_insert (segment_t * s)
+  {
+    int n = s->seq, t = tree, *tp = &tree, up = -1;
+    node[n].s = s;
+    node[n].left = node[n].right = -1;
+    node[n].priority = n * 2654435761U;
+    while (t >= 0)
+      {
+	up = t;
+	tp = (above (s, node[t].s) ? &node[t].right : &node[t].left);
+	t = *tp;
+      }
+    tree_attach (n, up, tp);
+    s->insweep = 1;
+    active[actives++] = n;
+    active_up (actives - 1);
+  }
+  void tree_delete (int n)
+  {
+    while (node[n].left >= 0 || node[n].right >= 0)
+      {				// rotate down to a leaf
+	int l = node[n].left, r = node[n].right;
+	tree_rotate ((r < 0 || (l >= 0 && node[l].priority > node[r].priority)) ? l : r);
+      }
+    int p = node[n].up;
+    if (p < 0)
+      tree = -1;
+    else if (node[p].left == n)
+      node[p].left = -1;
+    else
+      node[p].right = -1;
+    node[n].s->insweep = 0;
+  }
+  int tree_next (int n)
+  {				// next above n, -1 if none
+    if (node[n].right >= 0)
+      {
+	n = node[n].right;
+	while (node[n].left >= 0)
+	  n = node[n].left;
+	return n;
+      }
+    while (node[n].up >= 0 && node[node[n].up].right == n)
+      n = node[n].up;
+    return node[n].up;
+  }
+  int tree_prev (int n)
+  {				// next below n, -1 if none
+    if (node[n].left >= 0)
+      {
+	n = node[n].left;
+	while (node[n].right >= 0)
+	  n = node[n].right;
+	return n;
+      }
+    while (node[n].up >= 0 && node[node[n].up].left == n)
+      n = node[n].up;
+    return node[n].up;
+  }
   segment_t *stage2;
+  int passes = 0;
   while (1)
-    {				// may run more than once, and splitting lines can change their angle and cause earlier non intersects to be intersects
+    {				// splitting lines moves them slightly, so may make them cross segments they were not checked against, if so run again
       int splits = 0;
+      if (passes++ == 1)
+	__sync_fetch_and_add (&stats.repeats, 1);
+      __sync_fetch_and_add (&stats.passes, 1);
       stage1 = sortsegs (stage1, segcount);
-      segment_t *sweep = NULL;	// Segments in current sweep line, in Y order
-      segment_t *queue = NULL;	// Queue of fragments from intersections to be added later, in X order
+      int seq = 0, queued = 0;
+      int unsure = 0;		// a split landed behind the sweep line, so may cross segments already gone
+      poly_dim_t lastx = stage1->ax;
       inline void recheck (segment_t * p)
       {				// split can change to be vertical when not before
 	if (p->ax != p->bx)
@@ -351,9 +1216,10 @@ poly_clip (int operation, int count, polygon_t * poly, ...)
 	p->ay = p->by;
 	p->by = t;
 	p->dir = 0 - p->dir;
+	p->sub = 0 - p->sub;
       }
       inline void split_line (segment_t * p, poly_dim_t x, poly_dim_t y)
-      {
+      {				// split p at x,y
 	if (x == p->ax && y == p->ay)
 	  return;
 	if (x == p->bx && y == p->by)
@@ -364,25 +1230,37 @@ poly_clip (int operation, int count, polygon_t * poly, ...)
 	  return;
 	splits++;
 	//fprintf (stderr, "Split %3d,%-3d %3d,%-3d %3d,%-3d\n", (int) p->ax, (int) p->ay, (int) x, (int) y, (int) p->bx, (int) p->by);
-	segment_t *n = MALLOC (sizeof (*n));
+	segment_t *n = poly_arena_alloc (arena, sizeof (*n));
 	n->ax = x;
 	n->ay = y;
 	n->bx = p->bx;
 	n->by = p->by;
 	n->flag = p->flag;
 	n->dir = p->dir;
+	n->sub = p->sub;
+	if (p->insweep && !p->moved && (x - p->ax) * (p->by - p->ay) != (y - p->ay) * (p->bx - p->ax))
+	  {			// not exactly on line, so check against those next to it in the sweep tree again
+	    if (moves == maxmoved)
+	      {
+		maxmoved = maxmoved * 2 + 64;
+		moved = realloc (moved, maxmoved * sizeof (*moved));
+		if (!moved)
+		  errx (1, "Cannot allocate moved list");
+	      }
+	    moved[moves++] = p;
+	    p->moved = 1;
+	  }
 	p->bx = x;
 	p->by = y;
 	recheck (n);
 	recheck (p);
-	segment_t **qq;
-	for (qq = &queue; (*qq) && (*qq)->ax < x; qq = &(*qq)->next);
-	n->next = *qq;
-	*qq = n;
-	n = p->next;
+	if (p->insweep)
+	  active_up (node[p->seq].heap);	// ends sooner, same place in tree
+	n->seq = queued++;	// last in first out at same X
+	queue_push (n);
       }
       inline void intersect_check (segment_t * a, segment_t * b)
-      {				// check for segments that cross
+      {				// check for segments that cross, and split them
 	if (!a || !b || a == b)
 	  return;
 	if (MIN (b->ay, b->by) > MAX (a->ay, a->by))
@@ -412,81 +1290,260 @@ poly_clip (int operation, int count, polygon_t * poly, ...)
 	if (poly_intersect_point (b->ax, b->ay, b->bx, b->by, a->bx, a->by, &x, &y, NULL, &pc2, NULL) && !pc2)
 	  split_line (b, a->bx, a->by);
       }
-      poly_dim_t lastx = stage1->ax;
-      stage2 = NULL;
-      segcount = 0;
-      void segment_tidy (poly_dim_t x)
-      {
-	segment_t *s, **ss = &sweep;
-	while ((s = *ss))
+      inline long double y_at (segment_t * s)
+      {				// Y where s crosses the sweep line
+	if (s->ax == s->bx || lastx <= s->ax)
+	  return s->ay;
+	if (lastx >= s->bx)
+	  return s->by;
+	return s->ay + (long double) (s->by - s->ay) * (lastx - s->ax) / (s->bx - s->ax);
+      }
+      inline int moved_above (segment_t * q, segment_t * s)
+      {				// q goes above s in the sweep tree at the sweep line, like above() but q need not start there
+	long double qy = y_at (q), sy = y_at (s);
+	if (qy != sy)
+	  return qy > sy;
+	int qe = (q->bx == lastx && q->ax != q->bx), se = (s->bx == lastx && s->ax != s->bx);
+	if (qe != se)
+	  return se;		// those ending go below those starting
+	poly_dim_t d = (q->by - q->ay) * (s->bx - s->ax) - (s->by - s->ay) * (q->bx - q->ax);
+	if (d)
+	  return d > 0;
+	return q->seq > s->seq;
+      }
+      void recheck_moved (void)
+      {				// check segments moved by a split against those now next to them
+	while (moves)
 	  {
-	    if (s->bx < x)
-	      {
-		*ss = s->next;
-		s->next = stage2;
-		stage2 = s;
-		segcount++;
-		continue;
+	    segment_t *p = moved[--moves];
+	    p->moved = 0;
+	    if (!p->insweep)
+	      continue;
+	    int a = tree_prev (p->seq), b = tree_next (p->seq), t;
+	    int down = (a >= 0 && y_at (node[a].s) > y_at (p));
+	    if (down || (b >= 0 && y_at (node[b].s) < y_at (p)))
+	      {			// moved past the next in the tree, so put it back in order, checking those it passed
+		tree_delete (p->seq);
+		int *tp = &tree, up = -1;
+		t = tree;
+		while (t >= 0)
+		  {
+		    up = t;
+		    tp = (moved_above (p, node[t].s) ? &node[t].right : &node[t].left);
+		    t = *tp;
+		  }
+		tree_attach (p->seq, up, tp);
+		p->insweep = 1;
+		if (a >= 0 && b >= 0)
+		  intersect_check (node[a].s, node[b].s);
+		if (down)
+		  for (t = tree_next (p->seq); t >= 0 && t != b && p->insweep; t = tree_next (t))
+		    intersect_check (p, node[t].s);
+		else
+		  for (t = tree_prev (p->seq); t >= 0 && t != a && p->insweep; t = tree_prev (t))
+		    intersect_check (node[t].s, p);
+		a = tree_prev (p->seq);
+		b = tree_next (p->seq);
 	      }
-	    ss = &s->next;
+	    if (a >= 0)
+	      intersect_check (node[a].s, p);
+	    if (b >= 0 && p->insweep)
+	      intersect_check (p, node[b].s);
 	  }
       }
-      inline void segment_add (segment_t * q)
-      {				// add segment, in order
+      stage2 = NULL;
+      segcount = 0;
+      void segment_remove (void)
+      {				// move the segment that ends first to stage2, and check the two either side that are now next to each other
+	int n = active_pop (), a = tree_prev (n), b = tree_next (n);
+	tree_delete (n);
+	segment_t *s = node[n].s;
+	s->next = stage2;
+	stage2 = s;
+	segcount++;
+	if (a >= 0 && b >= 0)
+	  intersect_check (node[a].s, node[b].s);
+	recheck_moved ();
+      }
+      void segment_add (segment_t * q)
+      {				// add segment, checking against those next to it in the sweep tree
 	//fprintf (stderr, "Add %3d,%-3d %3d,%-3d %d\n", (int) q->ax, (int) q->ay, (int) q->bx, (int) q->by, q->dir);
-	// Not trying to keep ordered.. Simply check against all existing segments
-	segment_t *s;
-	for (s = sweep; s; s = s->next)
-	  intersect_check (s, q);
-	q->next = sweep;
-	sweep = q;
-	if (q->ax != lastx)
-	  segment_tidy (lastx = q->ax);
-      }
-      while (stage1 || queue)
+	if (seq == maxnode)
+	  {
+	    maxnode = maxnode * 2 + 64;
+	    node = realloc (node, maxnode * sizeof (*node));
+	    active = realloc (active, maxnode * sizeof (*active));
+	    if (!node || !active)
+	      errx (1, "Cannot allocate sweep tree");
+	  }
+	q->seq = seq++;
+	if (q->ax < lastx)
+	  unsure = 1;		// behind the sweep line, from a split that moved
+	lastx = q->ax;
+	tree_insert (q);
+	// check next below and above, and any beyond that pass through the start of this
+	int n;
+	for (n = tree_prev (q->seq); n >= 0; n = tree_prev (n))
+	  {
+	    intersect_check (node[n].s, q);
+	    if (!through (node[n].s, q->ax, q->ay))
+	      break;
+	  }
+	for (n = tree_next (q->seq); n >= 0; n = tree_next (n))
+	  {
+	    intersect_check (node[n].s, q);
+	    if (!through (node[n].s, q->ax, q->ay))
+	      break;
+	  }
+	recheck_moved ();
+      }
+      while (stage1 || queues || actives)
 	{			// Sweep
-	  segment_t *s = NULL;
-	  if (stage1 && (!queue || queue->ax > stage1->ax))
-	    {
-	      s = stage1;
-	      stage1 = s->next;
+	  poly_dim_t x = POLY_DIM_MAX;
+	  if (stage1)
+	    x = stage1->ax;
+	  if (queues && queue[0]->ax <= x)
+	    x = queue[0]->ax;
+	  if (actives && node[active[0]].s->bx < x)
+	    {			// ends before next to add
+	      segment_remove ();
+	      continue;
 	    }
+	  segment_t *s;
+	  if (queues && queue[0]->ax == x)
+	    s = queue_pop ();
 	  else
 	    {
-	      s = queue;
-	      queue = s->next;
+	      s = stage1;
+	      stage1 = s->next;
 	    }
 	  segment_add (s);
 	}
-      segment_tidy (POLY_DIM_MAX);
-      if (!splits)
+      __sync_fetch_and_add (&stats.splits, splits);
+      if (!unsure)
 	break;
       stage1 = stage2;		// try again
     }
+  free (node);
+  free (active);
+  free (queue);
+  free (moved);
 
   if (!stage2)
-    return new;
+    {
+      poly_arena_free (arena);
+      return poly_new ();
+    }
   stage2 = sortsegs (stage2, segcount);
+  polygon_t *out = poly_arena_alloc (arena, sizeof (*out));	// result in the arena, tidied and unpacked once at the end
   // make paths
   typedef struct path_s path_t;
   struct path_s
   {
-    path_t *next;
+    path_t *next, *prev;	// open paths, newest first
+    path_t *nexta, *nextb;	// hash chains by start and end point
+    int seq;			// order made
     poly_vertex_t *a, *b;
   };
   path_t *paths = NULL;
+  path_t **hasha = NULL, **hashb = NULL;	// open paths by start and end point
+  int hashbits = 0, pathcount = 0, pathseq = 0;
+  inline unsigned int path_hash (poly_dim_t x, poly_dim_t y)
+  {
+    unsigned long long h = (unsigned long long) (long long) x * 0x9E3779B97F4A7C15ULL ^ (unsigned long long) (long long) y * 0xC2B2AE3D27D4EB4FULL;
+    return (h ^ (h >> 29)) >> (64 - hashbits);
+  }
+  void path_hash_add (path_t * P)
+  {
+    unsigned int h = path_hash (P->a->x, P->a->y);
+    P->nexta = hasha[h];
+    hasha[h] = P;
+    h = path_hash (P->b->x, P->b->y);
+    P->nextb = hashb[h];
+    hashb[h] = P;
+  }
+  void path_hash_remove (path_t * P, int a, int b)
+  {				// remove start and/or end of path from hash
+    path_t **pp;
+    if (a)
+      {
+	for (pp = &hasha[path_hash (P->a->x, P->a->y)]; *pp != P; pp = &(*pp)->nexta);
+	*pp = P->nexta;
+      }
+    if (b)
+      {
+	for (pp = &hashb[path_hash (P->b->x, P->b->y)]; *pp != P; pp = &(*pp)->nextb);
+	*pp = P->nextb;
+      }
+  }
+  path_t *path_ending (poly_dim_t x, poly_dim_t y)
+  {				// newest path ending at x,y
+    path_t *P, *best = NULL;
+    if (!pathcount)
+      return NULL;
+    for (P = hashb[path_hash (x, y)]; P; P = P->nextb)
+      if (P->b->x == x && P->b->y == y && (!best || P->seq > best->seq))
+	best = P;
+    return best;
+  }
+  path_t *path_starting (poly_dim_t x, poly_dim_t y)
+  {				// newest path starting at x,y
+    path_t *P, *best = NULL;
+    if (!pathcount)
+      return NULL;
+    for (P = hasha[path_hash (x, y)]; P; P = P->nexta)
+      if (P->a->x == x && P->a->y == y && (!best || P->seq > best->seq))
+	best = P;
+    return best;
+  }
+  void path_new (path_t * P)
+  {
+    P->seq = pathseq++;
+    P->next = paths;
+    if (paths)
+      paths->prev = P;
+    paths = P;
+    if (++pathcount > (1 << hashbits) / 2)
+      {				// grow hash
+	free (hasha);
+	free (hashb);
+	hashbits = (hashbits ? hashbits + 1 : 8);
+	hasha = MALLOC (sizeof (*hasha) << hashbits);
+	hashb = MALLOC (sizeof (*hashb) << hashbits);
+	for (P = paths; P; P = P->next)
+	  path_hash_add (P);
+      }
+    else
+      path_hash_add (P);
+  }
+  void path_done (path_t * P)
+  {				// remove closed or joined path
+    path_hash_remove (P, 1, 1);
+    if (P->prev)
+      P->prev->next = P->next;
+    else
+      paths = P->next;
+    if (P->next)
+      P->next->prev = P->prev;
+    pathcount--;
+  }
   typedef struct point_s point_t;
   struct point_s
   {
     point_t *next;
     int flag;
     int dir;
+    int sub;
     int use;
     poly_dim_t ax, ay, bx, by;
   };
   point_t *points = NULL, **yp = NULL, *p;
   poly_dim_t lastx = stage2->ax - 1;
-  int wind = 0;
+  int wind = 0, windsub = 0;	// winding of all, and of polygons after the first
+  inline int subtract (int wind, int windsub)
+  {				// inside first and not any of the rest
+    return wind - windsub >= 1 && windsub < 1;
+  }
   void paths_close (poly_dim_t x)
   {
     point_t *p, **pp = &points;
@@ -505,17 +1562,17 @@ poly_clip (int operation, int count, polygon_t * poly, ...)
 		    swap (p->ay, p->by);
 		  }
 		// Any paths that can run on to A
-		path_t *A, *B;
-		for (A = paths; A && (A->b->x != p->ax || A->b->y != p->ay); A = A->next);
-		for (B = paths; B && (B->a->x != p->bx || B->a->y != p->by); B = B->next);
+		path_t *A = path_ending (p->ax, p->ay), *B = path_starting (p->bx, p->by);
 		if (A && B)
 		  {		// closed/joined path
+		    A->b->flag = p->flag;
 		    if (A == B)
 		      {		// close path
-			poly_contour_t *c = MALLOC (sizeof (*c));
-			c->next = new->contours;
-			new->contours = c;
+			poly_contour_t *c = poly_arena_alloc (arena, sizeof (*c));
+			c->next = out->contours;
+			out->contours = c;
 			c->vertices = A->a;
+			c->clipped = 1;
 			if (p->use > 0)
 			  c->dir = 1;
 			else if (p->use < 0)
@@ -525,51 +1582,57 @@ poly_clip (int operation, int count, polygon_t * poly, ...)
 		      }
 		    else
 		      {		// join path
+			path_hash_remove (A, 0, 1);
 			A->b->next = B->a;
 			A->b = B->b;
-			A->b->flag=p->flag;
+			unsigned int h = path_hash (A->b->x, A->b->y);
+			A->nextb = hashb[h];
+			hashb[h] = A;
 		      }
-		    path_t **pp;
-		    for (pp = &paths; *pp && *pp != B; pp = &(*pp)->next);
-		    *pp = B->next;
-		    free (B);
+		    path_done (B);
 		  }
 		else if (A)
 		  {		// tack on A
-		    poly_vertex_t *v = MALLOC (sizeof (*v));
+		    path_hash_remove (A, 0, 1);
+		    poly_vertex_t *v = poly_arena_alloc (arena, sizeof (*v));
 		    v->x = p->bx;
 		    v->y = p->by;
 		    A->b->flag = p->flag;
 		    A->b->next = v;
 		    A->b = v;
+		    unsigned int h = path_hash (v->x, v->y);
+		    A->nextb = hashb[h];
+		    hashb[h] = A;
 		  }
 		else if (B)
 		  {		// tack on B
-		    poly_vertex_t *v = MALLOC (sizeof (*v));
+		    path_hash_remove (B, 1, 0);
+		    poly_vertex_t *v = poly_arena_alloc (arena, sizeof (*v));
 		    v->x = p->ax;
 		    v->y = p->ay;
 		    v->flag = p->flag;
 		    v->next = B->a;
 		    B->a = v;
+		    unsigned int h = path_hash (v->x, v->y);
+		    B->nexta = hasha[h];
+		    hasha[h] = B;
 		  }
 		else
 		  {		// new
-		    poly_vertex_t *v = MALLOC (sizeof (*v));
-		    A = MALLOC (sizeof (*A));
-		    A->next = paths;
-		    paths = A;
+		    poly_vertex_t *v = poly_arena_alloc (arena, sizeof (*v));
+		    A = poly_arena_alloc (arena, sizeof (*A));
 		    v->x = p->ax;
 		    v->y = p->ay;
 		    v->flag = p->flag;
 		    A->a = v;
-		    v = MALLOC (sizeof (*v));
+		    v = poly_arena_alloc (arena, sizeof (*v));
 		    v->x = p->bx;
 		    v->y = p->by;
 		    A->b = v;
 		    A->a->next = v;
+		    path_new (A);
 		  }
 	      }
-	    free (p);
 	    continue;
 	  }
 	pp = &p->next;
@@ -583,21 +1646,17 @@ poly_clip (int operation, int count, polygon_t * poly, ...)
 	{			// combine multiple segments to cancel out as needed
 	  s->flag += stage2->flag;
 	  s->dir += stage2->dir;
-	  segment_t *n = stage2;
-	  stage2 = n->next;
-	  free (n);
-	}
-      if (!s->dir)
-	{
-	  free (s);
-	  continue;
+	  s->sub += stage2->sub;
+	  stage2 = stage2->next;
 	}
+      if (!s->dir && (operation != POLY_SUBTRACT || !s->sub))
+	continue;
       if (s->ax != lastx)
 	{			// start new column
 	  //fprintf (stderr, "Sweep X=%d\n", (int) s->ax);
 	  paths_close (lastx = s->ax);
 	  yp = &points;
-	  wind = 0;
+	  wind = windsub = 0;
 	}
       while ((p = *yp))
 	{
@@ -605,10 +1664,15 @@ poly_clip (int operation, int count, polygon_t * poly, ...)
 	    break;
 	  //fprintf (stderr, "Pass %3d,%-3d %3d,%-3d %d\n", (int) p->ax, (int) p->ay, (int) p->bx, (int) p->by, p->dir);
 	  wind -= p->dir;
+	  windsub -= p->sub;
 	  yp = &p->next;
 	}
-      int use = 0, dir = -s->dir;
-      if (operation > 0)
+      int use = 0, dir = -s->dir, dirsub = -s->sub;
+      if (operation == POLY_SUBTRACT)
+	{			// First minus the rest
+	  use = subtract (wind, windsub) - subtract (wind + dir, windsub + dirsub);
+	}
+      else if (operation > 0)
 	{			// Union/intersect
 	  if (wind < operation && wind + dir >= operation)
 	    use--;
@@ -632,10 +1696,13 @@ poly_clip (int operation, int count, polygon_t * poly, ...)
 	    use--;
 	}
       //fprintf (stderr, "Process %3d,%-3d %3d,%-3d %d->%d %d %s\n", (int) s->ax, (int) s->ay, (int) s->bx, (int) s->by, wind, wind + dir, use, (s->ax == s->bx) ? "V" : "");
-      if (s->bx > s->ax)	// don't count passing a vertical
-	wind += dir;
+      if (s->bx > s->ax)
+	{			// don't count passing a vertical
+	  wind += dir;
+	  windsub += dirsub;
+	}
 
-      p = MALLOC (sizeof (*p));
+      p = poly_arena_alloc (arena, sizeof (*p));
       p->next = *yp;
       *yp = p;
       p->ax = s->ax;
@@ -643,10 +1710,10 @@ poly_clip (int operation, int count, polygon_t * poly, ...)
       p->bx = s->bx;
       p->by = s->by;
       p->dir = s->dir;
+      p->sub = s->sub;
       p->flag = s->flag;
       p->use = use;
       yp = &p->next;
-      free (s);
     }
   paths_close (POLY_DIM_MAX);
   if (paths)
@@ -658,17 +1725,236 @@ poly_clip (int operation, int count, polygon_t * poly, ...)
 	  for (v = paths->a; v; v = v->next)
 	    fprintf (stderr, " %3d,%-3d", (int) v->x, (int) v->y);
 	  fprintf (stderr, "\n");
-	  poly_contour_t *c = MALLOC (sizeof (*c));
-	  c->next = new->contours;
-	  new->contours = c;
+	  poly_contour_t *c = poly_arena_alloc (arena, sizeof (*c));
+	  c->next = out->contours;
+	  out->contours = c;
 	  c->vertices = paths->a;
-	  path_t *p = paths;
-	  paths = p->next;
-	  free (p);
+	  paths = paths->next;
 	}
       // errx (1, "Unclosed paths\n");
     }
-  poly_tidy (new, 0);
+  free (hasha);
+  free (hashb);
+  poly_packed_t *result = poly_pack (arena, out);
+  poly_packed_tidy (result);
+  polygon_t *new = poly_unpack (result);
+  poly_arena_free (arena);
+  return new;
+}
+
+polygon_t *
+poly_clip_packed (int operation, int count, poly_packed_t ** packed)
+{				// return set of simple contours from one or more input polygons
+  // Contours whose bounding boxes cannot overlap cannot interact, so groups of them separated by a line in X or Y are
+  // clipped on their own, and a contour from an earlier clip that is on its own is simply copied or dropped
+  __sync_fetch_and_add (&stats.clips, 1);
+  int n, c, v, contours = 0;
+  for (n = 0; n < count; n++)
+    if (packed[n])
+      {
+	poly_packed_tidy (packed[n]);
+	contours += packed[n]->contours;
+      }
+  if (operation == POLY_ALL)
+    {				// Inside all, which is winding of count if each has winding of 0 or 1
+      for (n = 0; n < count; n++)
+	if (!packed[n] || !packed[n]->contours)
+	  return poly_new ();	// nothing is inside an empty polygon
+      poly_arena_t *arena = NULL;
+      poly_packed_t **each = NULL;
+      for (n = 0; n < count; n++)
+	{
+	  for (c = 0; c < packed[n]->contours && packed[n]->clipped[c]; c++);
+	  if (c == packed[n]->contours)
+	    continue;		// all contours exactly as clipped, so already winding 0 or 1
+	  if (!arena)
+	    {
+	      arena = poly_arena_new ();
+	      each = poly_arena_alloc (arena, count * sizeof (*each));
+	      memcpy (each, packed, count * sizeof (*each));
+	    }
+	  polygon_t *u = poly_clip_packed (POLY_UNION, 1, packed + n);
+	  each[n] = poly_pack (arena, u);
+	  poly_free (u);
+	}
+      polygon_t *new = poly_clip_packed (count, count, each ? : packed);
+      poly_arena_free (arena);
+      return new;
+    }
+  if (contours < 2)
+    return poly_clip_sweep (operation, count, packed);
+  typedef struct box_s box_t;
+  struct box_s
+  {
+    poly_dim_t minx, miny, maxx, maxy;
+    int poly, contour;
+  };
+  box_t *box = MALLOC (contours * sizeof (*box));
+  contours = 0;
+  for (n = 0; n < count; n++)
+    if (packed[n])
+      for (c = 0; c < packed[n]->contours; c++)
+	{
+	  poly_packed_t *p = packed[n];
+	  box_t *b = box + contours++;
+	  b->poly = n;
+	  b->contour = c;
+	  b->minx = b->maxx = p->x[p->start[c]];
+	  b->miny = b->maxy = p->y[p->start[c]];
+	  for (v = p->start[c] + 1; v < p->start[c + 1]; v++)
+	    {
+	      if (p->x[v] < b->minx)
+		b->minx = p->x[v];
+	      if (p->x[v] > b->maxx)
+		b->maxx = p->x[v];
+	      if (p->y[v] < b->miny)
+		b->miny = p->y[v];
+	      if (p->y[v] > b->maxy)
+		b->maxy = p->y[v];
+	    }
+	}
+  int byx (const void *a, const void *b)
+  {
+    poly_dim_t d = ((box_t *) a)->minx - ((box_t *) b)->minx;
+    return (d < 0) ? -1 : (d > 0) ? 1 : 0;
+  }
+  int byy (const void *a, const void *b)
+  {
+    poly_dim_t d = ((box_t *) a)->miny - ((box_t *) b)->miny;
+    return (d < 0) ? -1 : (d > 0) ? 1 : 0;
+  }
+  int groups = 0;
+  box_t **group = MALLOC (contours * sizeof (*group));	// start of each group
+  typedef struct part_s part_t;
+  struct part_s
+  {
+    box_t *b;
+    int n, axis, tried;
+  };
+  part_t *stack = MALLOC (contours * sizeof (*stack));	// parts still to split, disjoint so no more than contours
+  int stacked = 0;
+  stack[stacked++] = (part_t) { box, contours, 0, 0 };
+  while (stacked)
+    {				// split in to groups separated in X or Y, alternately, until no more splits in either
+      part_t p = stack[--stacked];
+      box_t *b = p.b;
+      int axis = p.axis;
+      qsort (b, p.n, sizeof (*b), axis ? byy : byx);
+      int i, s = 0, first = stacked;
+      poly_dim_t max = (axis ? b[0].maxy : b[0].maxx);
+      for (i = 1; i < p.n; i++)
+	{
+	  if ((axis ? b[i].miny : b[i].minx) > max)
+	    {
+	      stack[stacked++] = (part_t) { b + s, i - s, !axis, 0 };
+	      s = i;
+	    }
+	  poly_dim_t m = (axis ? b[i].maxy : b[i].maxx);
+	  if (m > max)
+	    max = m;
+	}
+      if (s)
+	{
+	  stack[stacked++] = (part_t) { b + s, p.n - s, !axis, 0 };
+	  for (i = 0; first + i < stacked - 1 - i; i++)
+	    {			// reverse so the parts come off the stack, and so make groups, in order
+	      part_t t = stack[first + i];
+	      stack[first + i] = stack[stacked - 1 - i];
+	      stack[stacked - 1 - i] = t;
+	    }
+	}
+      else if (!p.tried)
+	stack[stacked++] = (part_t) { b, p.n, !axis, 1 };
+      else
+	group[groups++] = b;
+    }
+  free (stack);
+  if (groups == 1)
+    {				// all interact
+      free (group);
+      free (box);
+      return poly_clip_sweep (operation, count, packed);
+    }
+  polygon_t *new = poly_new ();
+  poly_arena_t *arena = NULL;
+  poly_packed_t **batch = NULL;
+  int vertices = 0;
+  void flush (void)
+  {				// clip the batch of groups
+    if (!arena)
+      return;
+    polygon_t *p = poly_clip_sweep (operation, count, batch);
+    poly_arena_free (arena);
+    arena = NULL;
+    vertices = 0;
+    poly_contour_t *c = p->contours;
+    if (c)
+      {
+	while (c->next)
+	  c = c->next;
+	c->next = new->contours;
+	new->contours = p->contours;
+	p->contours = NULL;
+      }
+    poly_free (p);
+  }
+  void add (box_t * b)
+  {				// add contour to the batch to clip
+    if (!arena)
+      {
+	arena = poly_arena_new ();
+	batch = poly_arena_alloc (arena, count * sizeof (*batch));
+	int n;
+	for (n = 0; n < count; n++)
+	  if (packed[n])
+	    batch[n] = poly_packed_new (arena, packed[n]->contours, packed[n]->vertices);
+      }
+    poly_packed_t *p = packed[b->poly], *q = batch[b->poly];
+    poly_packed_start (q);
+    q->dir[q->contours - 1] = p->dir[b->contour];
+    q->clipped[q->contours - 1] = p->clipped[b->contour];
+    int v;
+    for (v = p->start[b->contour]; v < p->start[b->contour + 1]; v++)
+      poly_packed_add (q, p->x[v], p->y[v], p->flag[v]);
+    vertices += p->start[b->contour + 1] - p->start[b->contour];
+  }
+  int g;
+  for (g = 0; g < groups; g++)
+    {
+      box_t *b = group[g], *e = (g + 1 < groups ? group[g + 1] : box + contours);
+      if (e - b == 1 && packed[b->poly]->clipped[b->contour])
+	{			// on its own, and from a clip so simple, it has winding 1 inside if clockwise, -1 if not
+	  poly_packed_t *p = packed[b->poly];
+	  long double area = 0;
+	  int first = p->start[b->contour], last = p->start[b->contour + 1];
+	  for (v = first; v < last; v++)
+	    {
+	      int w = (v + 1 < last ? v + 1 : first);
+	      area += (long double) p->x[v] * p->y[w] - (long double) p->x[w] * p->y[v];
+	    }
+	  if (area < 0)
+	    {			// winding 1, which is in the result for union, xor, difference of more than 1, and subtract if first
+	      if (operation == 1 || !operation || operation < -1 || (operation == POLY_SUBTRACT && !b->poly))
+		{
+		  poly_start (new);
+		  for (v = first; v < last; v++)
+		    poly_add (new, p->x[v], p->y[v], p->flag[v]);
+		  new->contours->dir = p->dir[b->contour];
+		  new->contours->clipped = 1;
+		}
+	      continue;
+	    }
+	  if (operation)
+	    continue;		// winding -1 is not in any result but xor, where it would need reversing
+	}
+      for (; b < e; b++)
+	add (b);
+      if (vertices >= POLY_BATCH)
+	flush ();
+    }
+  flush ();
+  free (group);
+  free (box);
   return new;
 }
 
@@ -40,6 +40,7 @@ struct poly_contour_s
   poly_contour_t *next;
   poly_vertex_t *vertices;
   int dir;
+  int clipped;			// straight from poly_clip, so simple with winding 1 or -1 inside, cleared if vertices are changed
 };
 
 struct poly_vertex_s
@@ -49,22 +50,68 @@ struct poly_vertex_s
   poly_dim_t x, y;
 };
 
+// Arena allocator - many small zeroed allocations, all freed at once
+typedef struct poly_arena_s poly_arena_t;
+poly_arena_t *poly_arena_new (void);	// New empty arena
+void *poly_arena_alloc (poly_arena_t *, size_t);	// Zeroed space from arena
+void poly_arena_free (poly_arena_t *);	// Free arena and everything allocated from it
+
+// Packed polygon - contours as ranges of contiguous vertex arrays, allocated from an arena
+typedef struct poly_packed_s poly_packed_t;
+struct poly_packed_s
+{
+  int contours;			// contours in use
+  int vertices;			// vertices in use
+  int maxcontours, maxvertices;	// space allocated
+  int *start;			// vertices of contour n are start[n] to start[n+1]-1
+  int *dir;			// dir of each contour
+  int *clipped;			// clipped of each contour
+  poly_dim_t *x, *y;		// co-ordinates of each vertex
+  int *flag;			// flag of each vertex
+};
+
 // General functions
 polygon_t *poly_new (void);	// New empty malloced polygon
 void poly_free (polygon_t *);	// Free malloced polygon, contours and vertices
 void poly_free_contour (poly_contour_t * c); // free a contour
+int poly_box (polygon_t *, poly_dim_t * minx, poly_dim_t * miny, poly_dim_t * maxx, poly_dim_t * maxy);	// Bounding box, returns 0 if empty
+int poly_overlap (polygon_t *, polygon_t *);	// Non zero if bounding boxes overlap
 void poly_start (polygon_t *);	// Start of new contour
 void poly_add (polygon_t *, poly_dim_t x, poly_dim_t y, int flag);	// Add point to end of new contour (adds new contour at start of contours if needed)
 
+poly_packed_t *poly_packed_new (poly_arena_t *, int contours, int vertices);	// New empty packed polygon with space for specified contours and vertices
+void poly_packed_start (poly_packed_t *);	// Start of new contour
+void poly_packed_add (poly_packed_t *, poly_dim_t x, poly_dim_t y, int flag);	// Add point to end of contour
+poly_packed_t *poly_pack (poly_arena_t *, polygon_t *);	// Make packed copy of polygon
+polygon_t *poly_unpack (poly_packed_t *);	// Make new malloced polygon from packed polygon
+
 void poly_tidy (polygon_t *, poly_dim_t tolerance);	// Remove dead ends and redundant midpoints from contours in situ, and remove contours of <3 vertices
+void poly_simplify (polygon_t *, poly_dim_t tolerance);	// Tidy, then remove vertices least area first keeping removed vertices within tolerance of new edges
 polygon_t *poly_inset (polygon_t *, poly_dim_t);	// make new polygon to right of (i.e. inside) existing contours at specified offset
+void poly_inset_multi (polygon_t *, const poly_dim_t * inset, int n, polygon_t ** out);	// make n new polygons, each offset from the same original by its inset
+extern int poly_inset_capsule;	// Set to make poly_inset use the old (slower) union of thick lines for each edge
 
 // Basic polygon operations - use winding number logic, i.e. clockwise inside clockwise is not a hole.
 #define POLY_UNION		1	// Union of all contours
 #define POLY_INTERSECT		2	// Intersection of count contours (can be higher for more layers intersected)
 #define POLY_DIFFERENCE		-2	// Union subtract intersect (takes intersect of this -ve level from union)
 #define POLY_XOR		0	// Simple odd/even logic regardless of contour direction
+#define POLY_SUBTRACT		-1	// First polygon minus all the rest, winding tracked separately for each
+#define POLY_ALL		0x7FFFFFFF	// Intersection of all count polygons, each taken as a union of its own contours
 polygon_t *poly_clip (int operation, int count, polygon_t *, ...);	// return set of simple contours from one or more input polygons
+polygon_t *poly_clipn (int operation, int count, polygon_t **);	// as poly_clip, from an array of polygons
+polygon_t *poly_clip_packed (int operation, int count, poly_packed_t **);	// as poly_clip, from packed polygons
+
+// Statistics
+typedef struct poly_stats_s poly_stats_t;
+struct poly_stats_s
+{
+  long long clips;		// poly_clip operations
+  long long passes;		// sweeps of segments
+  long long repeats;		// clips needing more than one sweep
+  long long splits;		// segments split at intersections
+};
+void poly_stats (poly_stats_t *);	// Get statistics so far
 
 // Test
 void poly_test (void);		// Run a series of tests and show output
@@ -122,10 +169,17 @@ poly_intersect_line (poly_dim_t ax, poly_dim_t ay, poly_dim_t bx, poly_dim_t by,
       long double abh = ((dx - cx) * (ay - cy) - (dy - cy) * (ax - cx));
       if (abp)
 	*abp = (long double) abh / d;
+#ifdef	POLY_FLOAT
       if (xp)
 	*xp = ax + (abh * (bx - ax)) / d;
       if (yp)
 	*yp = ay + (abh * (by - ay)) / d;
+#else
+      if (xp)
+	*xp = ax + llroundl ((abh * (bx - ax)) / d);	// nearest grid point
+      if (yp)
+	*yp = ay + llroundl ((abh * (by - ay)) / d);
+#endif
     }
   if (cdp)
     *cdp = (long double) ((bx - ax) * (ay - cy) - (by - ay) * (ax - cx)) / d;